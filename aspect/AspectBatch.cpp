@@ -0,0 +1,227 @@
+#include "AspectBatch.hpp"
+#include "compression.hpp"
+#include "utilities.hpp"
+#include <unistd.h>
+#include <iostream>
+
+//cfitsio is not guaranteed to be built reentrant, so FITS reads are
+//serialized. Reading is cheap compared to running Aspect on the frame.
+static pthread_mutex_t mutexFITS = PTHREAD_MUTEX_INITIALIZER;
+
+int LoadFrameFile(const std::string &filename, cv::Mat &frame)
+{
+    int result;
+    if (filename.find("fit", 0) != std::string::npos)
+    {
+        pthread_mutex_lock(&mutexFITS);
+        result = readFITSImage(filename, frame);
+        pthread_mutex_unlock(&mutexFITS);
+        return result;
+    }
+    else if (filename.find("png", 0) != std::string::npos)
+    {
+        frame = cv::imread(filename, 0);
+        return frame.empty() ? -1 : 0;
+    }
+    else
+    {
+        std::cerr << "AspectBatch: " << filename << " isn't a valid type\n";
+        return -1;
+    }
+}
+
+AspectBatch::AspectBatch(int workers)
+{
+    if (workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    numWorkers = (workers > 0) ? workers : 1;
+
+    warmup = 2;
+    chunkSize = 0;
+
+    frames = NULL;
+    output = NULL;
+    nextChunk = numChunks = activeChunkSize = loadFailures = 0;
+    pthread_mutex_init(&mutex, NULL);
+}
+
+AspectBatch::~AspectBatch()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+void AspectBatch::SetFloat(AspectFloat variable, float value)
+{
+    floatSettings.push_back(std::make_pair(variable, value));
+}
+
+void AspectBatch::SetInteger(AspectInt variable, int value)
+{
+    intSettings.push_back(std::make_pair(variable, value));
+}
+
+void AspectBatch::SetWarmup(int frames)
+{
+    warmup = (frames > 0) ? frames : 0;
+}
+
+void AspectBatch::SetChunkSize(int frames)
+{
+    chunkSize = (frames > 0) ? frames : 0;
+}
+
+int AspectBatch::GetNumWorkers()
+{
+    return numWorkers;
+}
+
+int AspectBatch::Run(const std::vector<std::string> &frameList,
+                     std::vector<AspectBatchResult> &results)
+{
+    std::vector<pthread_t> threads;
+    int N = frameList.size();
+
+    results.clear();
+    results.resize(N);
+    if (N == 0) return 0;
+
+    frames = &frameList;
+    output = &results;
+    loadFailures = 0;
+    nextChunk = 0;
+
+    //Several chunks per worker keeps the cores busy when some stretches of
+    //the flight (e.g. no sun) run much faster than others. Chunks smaller
+    //than a few times the warm-up would spend most of their time warming up.
+    activeChunkSize = chunkSize;
+    if (activeChunkSize <= 0)
+    {
+        activeChunkSize = N/(4*numWorkers);
+        if (activeChunkSize < 8*(warmup+1)) activeChunkSize = 8*(warmup+1);
+    }
+    numChunks = (N + activeChunkSize - 1)/activeChunkSize;
+
+    int workers = (numWorkers < numChunks) ? numWorkers : numChunks;
+    threads.resize(workers);
+    for (int k = 0; k < workers; k++)
+    {
+        if (pthread_create(&threads[k], NULL, WorkerThread, this) != 0)
+        {
+            std::cerr << "AspectBatch: could not start worker " << k << std::endl;
+            threads.resize(k);
+            break;
+        }
+    }
+    //With no threads at all, fall back to doing the work here
+    if (threads.size() == 0)
+        Work();
+
+    for (unsigned int k = 0; k < threads.size(); k++)
+        pthread_join(threads[k], NULL);
+
+    frames = NULL;
+    output = NULL;
+    return loadFailures;
+}
+
+void *AspectBatch::WorkerThread(void *arg)
+{
+    ((AspectBatch *) arg)->Work();
+    return NULL;
+}
+
+bool AspectBatch::NextChunk(int &start, int &stop)
+{
+    bool found = false;
+    pthread_mutex_lock(&mutex);
+    if (nextChunk < numChunks)
+    {
+        start = nextChunk*activeChunkSize;
+        stop = start + activeChunkSize;
+        if (stop > (int) frames->size()) stop = frames->size();
+        nextChunk++;
+        found = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return found;
+}
+
+void AspectBatch::Work()
+{
+    Aspect aspect;
+    cv::Mat frame;
+    timespec startTime, stopTime, diffTime;
+    int start, stop, failures = 0;
+
+    for (unsigned int k = 0; k < floatSettings.size(); k++)
+        aspect.SetFloat(floatSettings[k].first, floatSettings[k].second);
+    for (unsigned int k = 0; k < intSettings.size(); k++)
+        aspect.SetInteger(intSettings[k].first, intSettings[k].second);
+
+    while (NextChunk(start, stop))
+    {
+        //Rebuild the tracking state this chunk would have inherited
+        aspect.ResetTracking();
+        for (int k = (start - warmup > 0 ? start - warmup : 0); k < start; k++)
+        {
+            if (LoadFrameFile((*frames)[k], frame) != 0) continue;
+            aspect.LoadFrame(frame);
+            aspect.Run();
+        }
+
+        for (int k = start; k < stop; k++)
+        {
+            AspectBatchResult &result = (*output)[k];
+            result.filename = (*frames)[k];
+            result.runTime = 0;
+            result.frameMin = result.frameMax = 0;
+
+            if (LoadFrameFile(result.filename, frame) != 0)
+            {
+                //An unreadable frame is handled like an empty one
+                frame.release();
+                failures++;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &startTime);
+            aspect.LoadFrame(frame);
+            result.runResult = aspect.Run();
+
+            //Get aspect data products depending on error severity
+            switch(GeneralizeError(result.runResult))
+            {
+            case NO_ERROR:
+                aspect.GetScreenCenter(result.screenCenter);
+                aspect.GetScreenFiducials(result.screenFiducials);
+                aspect.GetMapping(result.mapping);
+
+            case MAPPING_ERROR:
+                aspect.GetFiducialIDs(result.fiducialIDs);
+
+            case ID_ERROR:
+                aspect.GetPixelFiducials(result.pixelFiducials);
+
+            case FIDUCIAL_ERROR:
+                aspect.GetPixelCenter(result.pixelCenter);
+                aspect.GetPixelError(result.pixelError);
+
+            case CENTER_ERROR:
+                aspect.GetPixelCrossings(result.limbCrossings);
+
+            case LIMB_ERROR:
+            case RANGE_ERROR:
+                aspect.GetPixelMinMax(result.frameMin, result.frameMax);
+                break;
+            default:
+                break;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &stopTime);
+            diffTime = TimespecDiff(startTime, stopTime);
+            result.runTime = diffTime.tv_sec + diffTime.tv_nsec/1e9;
+        }
+    }
+
+    pthread_mutex_lock(&mutex);
+    loadFailures += failures;
+    pthread_mutex_unlock(&mutex);
+}
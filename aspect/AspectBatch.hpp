@@ -0,0 +1,87 @@
+#ifndef _ASPECTBATCH_HPP_
+#define _ASPECTBATCH_HPP_
+
+/* AspectBatch runs a list of archived frames through several independent
+   Aspect workers for offline reprocessing.
+
+   The frame list is cut into contiguous chunks which are handed out to the
+   workers. Each Aspect carries tracking state (pixelCenter, solarImage) from
+   one frame to the next, so at the start of every chunk a worker resets its
+   tracking and first runs a few "warm-up" frames from just before the chunk,
+   discarding their results. That way each frame sees roughly the same
+   tracking history it would have seen in a single sequential pass.
+
+   Results are written into slots indexed by the frame's position in the
+   input list, so they come back in input order no matter which worker
+   processed them.
+*/
+
+#include "processing.hpp"
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+struct AspectBatchResult
+{
+    std::string filename;
+    AspectCode runResult;
+    double runTime; //seconds spent in LoadFrame and Run
+
+    unsigned char frameMin, frameMax;
+    CoordList limbCrossings;
+    cv::Point2f pixelCenter, pixelError;
+    CoordList pixelFiducials;
+    IndexList fiducialIDs;
+    std::vector<float> mapping;
+    cv::Point2f screenCenter;
+    CoordList screenFiducials;
+};
+
+class AspectBatch
+{
+public:
+    //numWorkers <= 0 uses one worker per online core
+    AspectBatch(int numWorkers = 0);
+    ~AspectBatch();
+
+    //Parameters are replayed onto every worker's Aspect before it starts
+    void SetFloat(AspectFloat variable, float value);
+    void SetInteger(AspectInt variable, int value);
+
+    //Number of frames run ahead of each chunk to rebuild tracking state
+    void SetWarmup(int frames);
+    //Number of frames handed to a worker at a time (0 picks a size
+    //that gives each worker several chunks)
+    void SetChunkSize(int frames);
+
+    int GetNumWorkers();
+
+    //Process every frame in the list. Returns the number of frames that
+    //could not be loaded.
+    int Run(const std::vector<std::string> &frameList,
+            std::vector<AspectBatchResult> &results);
+
+private:
+    int numWorkers;
+    int warmup;
+    int chunkSize;
+
+    std::vector<std::pair<AspectFloat, float> > floatSettings;
+    std::vector<std::pair<AspectInt, int> > intSettings;
+
+    //Shared state for a call to Run, protected by mutex
+    const std::vector<std::string> *frames;
+    std::vector<AspectBatchResult> *output;
+    int nextChunk, numChunks, activeChunkSize, loadFailures;
+    pthread_mutex_t mutex;
+
+    static void *WorkerThread(void *arg);
+    void Work();
+    bool NextChunk(int &start, int &stop);
+};
+
+//Loads a FITS or PNG frame from disk. Returns 0 on success.
+int LoadFrameFile(const std::string &filename, cv::Mat &frame);
+
+#endif
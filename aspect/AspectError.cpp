@@ -11,16 +11,19 @@ AspectCode GeneralizeError(AspectCode code)
 
     case MAPPING_ERROR:
     case MAPPING_ILL_CONDITIONED:
+    case MAPPING_TIMEOUT:
         return MAPPING_ERROR;
 
     case ID_ERROR:
     case FEW_IDS:
     case NO_IDS:
+    case ID_TIMEOUT:
         return ID_ERROR;
 
     case FIDUCIAL_ERROR:
     case FEW_FIDUCIALS:
     case NO_FIDUCIALS:
+    case FIDUCIAL_TIMEOUT:
     case SOLAR_IMAGE_ERROR:
     case SOLAR_IMAGE_OFFSET_OUT_OF_BOUNDS:
     case SOLAR_IMAGE_SMALL:
@@ -35,11 +38,13 @@ AspectCode GeneralizeError(AspectCode code)
     case LIMB_ERROR:
     case FEW_LIMB_CROSSINGS:
     case NO_LIMB_CROSSINGS:
+    case LIMB_TIMEOUT:
         return LIMB_ERROR;
 
     case RANGE_ERROR:
     case MIN_MAX_BAD:
     case DYNAMIC_RANGE_LOW:
+    case FRAME_SATURATED:
         return RANGE_ERROR;
 
     case FRAME_EMPTY:
@@ -67,6 +72,9 @@ const char * GetMessage(const AspectCode& code)
     case MAPPING_ILL_CONDITIONED:
         return "Mapping was ill-conditioned";
 
+    case MAPPING_TIMEOUT:
+        return "Out of time before mapping";
+
     case ID_ERROR:
         return "Generic IDing error";
 
@@ -76,6 +84,9 @@ const char * GetMessage(const AspectCode& code)
     case NO_IDS:
         return "No valid IDs found";
 
+    case ID_TIMEOUT:
+        return "Out of time before IDing fiducials";
+
     case FIDUCIAL_ERROR:
         return "Generic fiducial error";
 
@@ -85,6 +96,9 @@ const char * GetMessage(const AspectCode& code)
     case NO_FIDUCIALS:
         return "No fiducials found";
 
+    case FIDUCIAL_TIMEOUT:
+        return "Out of time before finding fiducials";
+
     case SOLAR_IMAGE_ERROR:
         return "Generic solar image error";
 
@@ -115,6 +129,9 @@ const char * GetMessage(const AspectCode& code)
     case NO_LIMB_CROSSINGS:
         return "No limb crossings";
 
+    case LIMB_TIMEOUT:
+        return "Out of time before finding limbs";
+
     case RANGE_ERROR:
         return "Generic dynamic range error";
 
@@ -124,6 +141,9 @@ const char * GetMessage(const AspectCode& code)
     case MIN_MAX_BAD:
         return "Dynamic values aren't real";
 
+    case FRAME_SATURATED:
+        return "Frame is saturated";
+
     case FRAME_EMPTY:
         return "Frame is empty.";
 
@@ -134,3 +154,40 @@ const char * GetMessage(const AspectCode& code)
         return "How did I get here?";
     }
 }
+
+unsigned char GetLegacyCode(const AspectCode& code)
+{
+    switch(code)
+    {
+    case NO_ERROR:                          return 0;
+    case MAPPING_ERROR:                     return 1;
+    case MAPPING_ILL_CONDITIONED:           return 2;
+    case MAPPING_TIMEOUT:                   return 1;
+    case ID_ERROR:                          return 3;
+    case FEW_IDS:                           return 4;
+    case NO_IDS:                            return 5;
+    case ID_TIMEOUT:                        return 3;
+    case FIDUCIAL_ERROR:                    return 6;
+    case FEW_FIDUCIALS:                     return 7;
+    case NO_FIDUCIALS:                      return 8;
+    case FIDUCIAL_TIMEOUT:                  return 6;
+    case SOLAR_IMAGE_ERROR:                 return 9;
+    case SOLAR_IMAGE_OFFSET_OUT_OF_BOUNDS:  return 10;
+    case SOLAR_IMAGE_SMALL:                 return 11;
+    case SOLAR_IMAGE_EMPTY:                 return 12;
+    case CENTER_ERROR:                      return 13;
+    case CENTER_ERROR_LARGE:                return 14;
+    case CENTER_OUT_OF_BOUNDS:              return 15;
+    case LIMB_ERROR:                        return 16;
+    case FEW_LIMB_CROSSINGS:                return 17;
+    case NO_LIMB_CROSSINGS:                 return 18;
+    case LIMB_TIMEOUT:                      return 16;
+    case RANGE_ERROR:                       return 19;
+    case DYNAMIC_RANGE_LOW:                 return 20;
+    case MIN_MAX_BAD:                       return 21;
+    case FRAME_SATURATED:                   return 19;
+    case FRAME_EMPTY:                       return 22;
+    case STALE_DATA:                        return 23;
+    default:                                return 23;
+    }
+}
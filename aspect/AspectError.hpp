@@ -7,6 +7,25 @@
 //   frame happens earlier in the processing chain than an error with
 //   the mapping
 //
+//   New codes go in the group they belong to, which renumbers the codes
+//   after them. Anything stored or sent as a number (telemetry, CSV files)
+//   should go through GetLegacyCode, which keeps the original numbering:
+//
+//   code                     value  legacy
+//   MAPPING_TIMEOUT              3     1 (MAPPING_ERROR)
+//   ID_ERROR..NO_IDS          4..6  3..5
+//   ID_TIMEOUT                   7     3 (ID_ERROR)
+//   FIDUCIAL_ERROR..NO_FID.   8..10  6..8
+//   FIDUCIAL_TIMEOUT            11     6 (FIDUCIAL_ERROR)
+//   SOLAR_IMAGE_*           12..15  9..12
+//   CENTER_*                16..18 13..15
+//   LIMB_ERROR..NO_LIMB     19..21 16..18
+//   LIMB_TIMEOUT                22    16 (LIMB_ERROR)
+//   RANGE_ERROR..MIN_MAX    23..25 19..21
+//   FRAME_SATURATED             26    19 (RANGE_ERROR)
+//   FRAME_EMPTY                 27    22
+//   STALE_DATA                  28    23
+//
 
 enum AspectCode
 {
@@ -14,13 +33,16 @@ enum AspectCode
 
     MAPPING_ERROR,
     MAPPING_ILL_CONDITIONED,
+    MAPPING_TIMEOUT,
 
     ID_ERROR,
     FEW_IDS,
     NO_IDS,
+    ID_TIMEOUT,
     FIDUCIAL_ERROR,
     FEW_FIDUCIALS,
     NO_FIDUCIALS,
+    FIDUCIAL_TIMEOUT,
 
     SOLAR_IMAGE_ERROR,
     SOLAR_IMAGE_OFFSET_OUT_OF_BOUNDS,
@@ -34,10 +56,12 @@ enum AspectCode
     LIMB_ERROR,
     FEW_LIMB_CROSSINGS,
     NO_LIMB_CROSSINGS,
+    LIMB_TIMEOUT,
 
     RANGE_ERROR,
     DYNAMIC_RANGE_LOW,
     MIN_MAX_BAD,
+    FRAME_SATURATED,
 
     FRAME_EMPTY,
 
@@ -51,4 +75,8 @@ AspectCode GeneralizeError(AspectCode code);
 //  Translates an error code into a human-readable message
 const char * GetMessage(const AspectCode& code);
 
+//  The value code had in the original numbering, for the 5-bit telemetry
+//  field and the CSV files. Codes added since map to their group.
+unsigned char GetLegacyCode(const AspectCode& code);
+
 #endif
@@ -31,6 +31,42 @@ const char * GetAspectIntName(const AspectInt& code)
     case NUM_FIDUCIALS:
         return "Max # Fiducials";
 
+    case MINMAX_ROI_REFRESH:
+        return "Min/Max ROI Refresh";
+
+    case CORRELATION_MODE:
+        return "Correlation Mode";
+
+    case KERNEL_RANK:
+        return "Kernel Rank";
+
+    case FIDUCIAL_TRACK_WINDOW:
+        return "Fiducial Track Window";
+
+    case CENTER_METHOD:
+        return "Center Method";
+
+    case FIDUCIAL_REFINE:
+        return "Fiducial Refine";
+
+    case ACQUISITION_LEVELS:
+        return "Acquisition Levels";
+
+    case NUM_THREADS:
+        return "# of Threads";
+
+    case DISK_MASK:
+        return "Disk Mask";
+
+    case ID_PERSISTENCE:
+        return "ID Persistence";
+
+    case GATE_STRIDE:
+        return "Gate Stride";
+
+    case CHECKPOINT_INTERVAL:
+        return "Checkpoint Interval";
+
     default:
         return "How did I get here?";
     }
@@ -64,6 +100,21 @@ const char * GetAspectFloatName(const AspectFloat& code)
     case FIDUCIAL_TWIST:
         return "Fiducial Twist";
 
+    case MINMAX_TOLERANCE:
+        return "Min/Max Tolerance";
+
+    case PREDICTOR_ALPHA:
+        return "Predictor Alpha";
+
+    case PREDICTOR_BETA:
+        return "Predictor Beta";
+
+    case TIME_BUDGET:
+        return "Time Budget";
+
+    case MOMENT_TOLERANCE:
+        return "Moment Tolerance";
+
     default:
         return "How did I get here?";
     }
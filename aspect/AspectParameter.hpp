@@ -10,7 +10,20 @@ enum AspectInt
     FIDUCIAL_LENGTH,
     FIDUCIAL_WIDTH,
     FIDUCIAL_NEIGHBORHOOD,
-    NUM_FIDUCIALS
+    NUM_FIDUCIALS,
+    MINMAX_ROI_REFRESH,
+    CORRELATION_MODE,
+    KERNEL_RANK,
+    FIDUCIAL_TRACK_WINDOW,
+    CENTER_METHOD,
+    FIDUCIAL_REFINE,
+    ACQUISITION_LEVELS,
+    NUM_THREADS,
+    DISK_MASK,
+    ID_PERSISTENCE,
+    GATE_STRIDE,
+    CHECKPOINT_INTERVAL,
+    NUM_ASPECT_INTS
 };
 
 enum AspectFloat
@@ -22,7 +35,37 @@ enum AspectFloat
     FIDUCIAL_THRESHOLD,
     FIDUCIAL_SPACING,
     FIDUCIAL_SPACING_TOL,
-    FIDUCIAL_TWIST
+    FIDUCIAL_TWIST,
+    MINMAX_TOLERANCE,
+    PREDICTOR_ALPHA,
+    PREDICTOR_BETA,
+    TIME_BUDGET,
+    MOMENT_TOLERANCE,
+    NUM_ASPECT_FLOATS
+};
+
+//Values for CORRELATION_MODE
+enum CorrelationMode
+{
+    CORRELATION_DENSE = 0,
+    CORRELATION_SEPARABLE,
+    CORRELATION_INTEGER
+};
+
+//Values for CENTER_METHOD
+enum CenterMethod
+{
+    CENTER_CHORDS = 0,
+    CENTER_CIRCLE_FIT,
+    CENTER_MOMENTS
+};
+
+//Values for FIDUCIAL_REFINE
+enum FiducialRefine
+{
+    REFINE_CENTROID = 0,
+    REFINE_PARABOLA,
+    REFINE_GAUSSIAN
 };
 
 const char *GetAspectIntName(const AspectInt& code);
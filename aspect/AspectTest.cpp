@@ -267,7 +267,7 @@ int main(int argc, char* argv[])
                 // Generate CSV of center data
                 csvCenter << index << ";";
                 csvCenter << filename << ";";
-                csvCenter << (int) runResult << ";";
+                csvCenter << (int) GetLegacyCode(runResult) << ";";
                 csvCenter << center.x << ";" << center.y << ";";
                 csvCenter << IDCenter.x << ";" << IDCenter.y << ";";
                 csvCenter << diffTime.tv_sec+((float)diffTime.tv_nsec)/1e9 << ";";
@@ -0,0 +1,131 @@
+#include "CheckpointWriter.hpp"
+#include <iostream>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+CheckpointWriter::CheckpointWriter(const std::string &newPath)
+{
+    path = newPath;
+    hasPending = false;
+    stopping = false;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&posted, NULL);
+
+    started = (pthread_create(&thread, NULL, WriterThread, this) == 0);
+    if (!started)
+    {
+        //Saving in the caller only makes Post slower
+        std::cerr << "CheckpointWriter: could not start writer" << std::endl;
+    }
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    //The writer finishes anything still pending before it stops
+    if (started)
+    {
+        pthread_mutex_lock(&mutex);
+        stopping = true;
+        pthread_cond_signal(&posted);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, NULL);
+    }
+
+    pthread_cond_destroy(&posted);
+    pthread_mutex_destroy(&mutex);
+}
+
+void CheckpointWriter::Post(const std::string &contents)
+{
+    if (!started)
+    {
+        Write(contents);
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    pending = contents;
+    hasPending = true;
+    pthread_cond_signal(&posted);
+    pthread_mutex_unlock(&mutex);
+}
+
+void *CheckpointWriter::WriterThread(void *arg)
+{
+    ((CheckpointWriter *) arg)->Work();
+    return NULL;
+}
+
+void CheckpointWriter::Work()
+{
+    std::string contents;
+
+    pthread_mutex_lock(&mutex);
+    while (true)
+    {
+        while (!hasPending && !stopping)
+            pthread_cond_wait(&posted, &mutex);
+        if (!hasPending)
+            break;
+
+        contents.swap(pending);
+        hasPending = false;
+        pthread_mutex_unlock(&mutex);
+
+        Write(contents);
+
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+bool CheckpointWriter::Write(const std::string &contents)
+{
+    std::string temporary = path + ".tmp";
+    size_t written = 0;
+    ssize_t count;
+
+    int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+        return false;
+    while (written < contents.size())
+    {
+        count = write(file, contents.data() + written, contents.size() - written);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        written += count;
+    }
+
+    //The new contents have to be on the disk before the rename can be,
+    //or a power cut could leave path naming an empty file
+    if (written < contents.size() || fsync(file) != 0)
+    {
+        close(file);
+        remove(temporary.c_str());
+        return false;
+    }
+    close(file);
+
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+
+    //Make the rename itself durable
+    size_t slash = path.rfind('/');
+    std::string directory = (slash == std::string::npos) ? "." :
+        (slash == 0) ? "/" : path.substr(0, slash);
+    int dir = open(directory.c_str(), O_RDONLY);
+    if (dir >= 0)
+    {
+        fsync(dir);
+        close(dir);
+    }
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef _CHECKPOINTWRITER_HPP_
+#define _CHECKPOINTWRITER_HPP_
+
+/* CheckpointWriter saves small state files from a thread of its own, so
+   the thread that produces the state never waits on the disk.
+
+   Post hands over the new contents of the file and returns at once. If the
+   writer is still busy with an earlier Post, only the latest contents are
+   kept, so a slow disk just means fewer saves. Each save is written to
+   path + ".tmp", flushed to the disk, and renamed over path, so the file
+   at path is always a complete save, old or new, even across a power cut.
+*/
+
+#include <pthread.h>
+#include <string>
+
+class CheckpointWriter
+{
+public:
+    CheckpointWriter(const std::string &path);
+    ~CheckpointWriter();
+
+    void Post(const std::string &contents);
+
+private:
+    std::string path;
+    pthread_t thread;
+    bool started;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t posted;
+
+    //The contents waiting to be written, protected by mutex
+    std::string pending;
+    bool hasPending;
+    bool stopping;
+
+    static void *WriterThread(void *arg);
+    void Work();
+    bool Write(const std::string &contents);
+
+    //Not copyable
+    CheckpointWriter(const CheckpointWriter &);
+    CheckpointWriter &operator=(const CheckpointWriter &);
+};
+
+#endif
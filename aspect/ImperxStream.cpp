@@ -8,6 +8,7 @@ ImperxStream::ImperxStream()
     lDeviceInfo = NULL;
     lDeviceParams = NULL;
     lStreamParams = NULL;
+    bitDepth = 8;
 }
 
 ImperxStream::~ImperxStream()
@@ -260,7 +261,7 @@ int ImperxStream::Snap(cv::Mat &frame, int timeout)
                 lWidth = (int) lImage->GetWidth();
                 lHeight = (int) lImage->GetHeight();
                 unsigned char *img = lImage->GetDataPointer();
-                cv::Mat lframe(lHeight,lWidth,CV_8UC1,img, cv::Mat::AUTO_STEP);
+                cv::Mat lframe(lHeight,lWidth,(bitDepth > 8) ? CV_16UC1 : CV_8UC1,img, cv::Mat::AUTO_STEP);
                 lframe.copyTo(frame);
                 result = 0;
             }
@@ -346,7 +347,13 @@ void ImperxStream::ConfigureSnap()
 {
     lDeviceParams->SetEnumValue("AcquisitionMode","SingleFrame");
     lDeviceParams->SetEnumValue("ExposureMode","Timed");
-    lDeviceParams->SetEnumValue("PixelFormat","Mono8");
+    //Mono10 and Mono12 come unpacked, one pixel per 16-bit word
+    if (bitDepth == 12)
+        lDeviceParams->SetEnumValue("PixelFormat","Mono12");
+    else if (bitDepth == 10)
+        lDeviceParams->SetEnumValue("PixelFormat","Mono10");
+    else
+        lDeviceParams->SetEnumValue("PixelFormat","Mono8");
     lDeviceParams->SetBooleanValue("AecEnable", false);
     lDeviceParams->SetBooleanValue("AgcEnable", false);
 }
@@ -529,6 +536,16 @@ int ImperxStream::SetBlackLevel(int black)
     return -1;
 }
 
+int ImperxStream::SetBitDepth(int bits)
+{
+    if (bits == 8 || bits == 10 || bits == 12)
+    {
+        bitDepth = bits;
+        return 0;
+    }
+    return -1;
+}
+
 int ImperxStream::GetExposure()
 {
     PvInt64 exposure;
@@ -618,3 +635,8 @@ int ImperxStream::GetPreAmpGain()
     }
     return gain;
 }
+
+int ImperxStream::GetBitDepth()
+{
+    return bitDepth;
+}
@@ -60,6 +60,9 @@ public:
     int SetAnalogGain(int gain);
     int SetBlackLevel(int black);
     int SetPreAmpGain(int gain);
+    //8 gives CV_8UC1 frames, 10 or 12 gives CV_16UC1 frames. Takes effect
+    //at the next ConfigureSnap.
+    int SetBitDepth(int bits);
     
     int GetExposure();
     cv::Size GetROISize();
@@ -71,6 +74,7 @@ public:
     int GetAnalogGain();
     int GetBlackLevel();
     int GetPreAmpGain();
+    int GetBitDepth();
 
     float getTemperature( void );
 
@@ -82,5 +86,6 @@ private:
     PvStream lStream;
     PvGenParameterArray *lStreamParams;
     PvPipeline lPipeline;
+    int bitDepth;
 };
 
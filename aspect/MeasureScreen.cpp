@@ -63,6 +63,8 @@ int main(int argc, char* argv[])
     timespec startTime, stopTime, diffTime;
     
     aspect.SetInteger(NUM_FIDUCIALS, 225);
+    //Calibration frames are searched whole, so spread them over every core
+    aspect.SetInteger(NUM_THREADS, 0);
     aspect.SetFloat(RADIUS_MARGIN, 20);
     aspect.SetFloat(FIDUCIAL_THRESHOLD, 5);
 
@@ -0,0 +1,117 @@
+#include "AspectBatch.hpp"
+#include "utilities.hpp"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+
+//Compares the sub-pixel fiducial refinement methods on archived frames.
+//Each frame is also run shifted by a known sub-pixel amount, and every
+//fiducial found in both is used to measure how well that shift is
+//recovered. Reports the RMS error of the recovered shift and the mean time
+//each method spends refining the fiducials of a frame.
+
+#define NUM_METHODS 3
+
+const char *methodNames[NUM_METHODS] = {"Centroid", "Parabola", "Gaussian"};
+
+//Runs a frame from scratch and returns its pixel fiducials, and the
+//milliseconds spent refining them (not the whole Run, which is dominated by
+//the chords and the correlation)
+static bool RunFrame(Aspect &aspect, cv::Mat &frame, CoordList &fiducials, double &refineTime)
+{
+    aspect.ResetTracking();
+    aspect.LoadFrame(frame);
+    AspectCode runResult = aspect.Run();
+    refineTime = aspect.GetRefineTime();
+
+    fiducials.clear();
+    return (ValidProducts(runResult) & PRODUCT_FIDUCIALS) &&
+        aspect.GetPixelFiducials(fiducials) == NO_ERROR;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2 && argc != 3)
+    {
+        std::cout << "Correct usage is: RefineBench frameList.txt [shift]\n";
+        return -1;
+    }
+
+    char line[256];
+    std::vector<std::string> frameList;
+    cv::Mat frame, shifted, transform;
+    CoordList fiducials, shiftedFiducials;
+    cv::Point2f shift;
+    double refineTime, maxShift = (argc == 3) ? atof(argv[2]) : 0.5;
+
+    Aspect aspect;
+    double totalTime[NUM_METHODS] = {0};
+    double squaredError[NUM_METHODS] = {0};
+    long matches[NUM_METHODS] = {0};
+    int runs[NUM_METHODS] = {0};
+
+    std::ifstream frames(argv[1]);
+    if (!frames.good())
+    {
+        std::cout << "Failed to open file list" << std::endl;
+        return -1;
+    }
+    while (frames.getline(line,256))
+        frameList.push_back(line);
+    frames.close();
+
+    srand(0);
+    for (unsigned int index = 0; index < frameList.size(); index++)
+    {
+        if (LoadFrameFile(frameList[index], frame) != 0) continue;
+
+        //Same random shift for every method
+        shift.x = maxShift*(2.0*rand()/RAND_MAX - 1);
+        shift.y = maxShift*(2.0*rand()/RAND_MAX - 1);
+        transform = cv::Mat::zeros(2, 3, CV_64FC1);
+        transform.at<double>(0,0) = 1;
+        transform.at<double>(0,2) = shift.x;
+        transform.at<double>(1,1) = 1;
+        transform.at<double>(1,2) = shift.y;
+        cv::warpAffine(frame, shifted, transform, frame.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+
+        for (int method = 0; method < NUM_METHODS; method++)
+        {
+            aspect.SetInteger(FIDUCIAL_REFINE, method);
+            if (!RunFrame(aspect, frame, fiducials, refineTime)) continue;
+            totalTime[method] += refineTime;
+            runs[method]++;
+            if (!RunFrame(aspect, shifted, shiftedFiducials, refineTime)) continue;
+            totalTime[method] += refineTime;
+            runs[method]++;
+
+            //Pair each fiducial with its shifted copy
+            for (unsigned int k = 0; k < fiducials.size(); k++)
+            {
+                for (unsigned int j = 0; j < shiftedFiducials.size(); j++)
+                {
+                    cv::Point2f error = shiftedFiducials[j] - fiducials[k] - shift;
+                    if (std::abs(error.x) < 2 && std::abs(error.y) < 2)
+                    {
+                        squaredError[method] += error.x*error.x + error.y*error.y;
+                        matches[method]++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    std::cout << "Method     RMS error (px)  Fiducials  Mean refine (ms)" << std::endl;
+    for (int method = 0; method < NUM_METHODS; method++)
+    {
+        std::cout << methodNames[method] << "\t"
+                  << (matches[method] ? std::sqrt(squaredError[method]/matches[method]) : 0) << "\t"
+                  << matches[method] << "\t"
+                  << (runs[method] ? totalTime[method]/runs[method] : 0) << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "AspectBatch.hpp"
+#include "utilities.hpp"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+//Offline reprocessing of a list of frames across all cores. Produces the
+//same CSV files as AspectTest.
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3 && argc != 4)
+    {
+        std::cout << "Correct usage is: Reprocess frameList.txt outfile.csv [workers]\n";
+        return -1;
+    }
+
+    char line[256];
+    std::vector<std::string> frameList;
+    std::vector<AspectBatchResult> results;
+    std::ofstream csvCenter, csvLimbs, csvFiducials;
+    timespec startTime, stopTime, diffTime;
+
+    std::string outfile(argv[2]);
+    outfile = outfile.substr(0, outfile.length()-4);
+
+    std::ifstream frames(argv[1]);
+    if (!frames.good())
+    {
+        std::cout << "Failed to open file list" << std::endl;
+        return -1;
+    }
+    while (frames.getline(line,256))
+        frameList.push_back(line);
+    frames.close();
+
+    AspectBatch batch(argc == 4 ? atoi(argv[3]) : 0);
+
+    std::cout << "Processing " << frameList.size() << " frames with "
+              << batch.GetNumWorkers() << " workers" << std::endl;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    int failures = batch.Run(frameList, results);
+    clock_gettime(CLOCK_MONOTONIC, &stopTime);
+    diffTime = TimespecDiff(startTime, stopTime);
+    std::cout << "Runtime : " << diffTime.tv_sec << nanoString(diffTime.tv_nsec) << std::endl;
+    if (failures > 0)
+        std::cout << failures << " frames could not be loaded" << std::endl;
+
+    csvCenter.open(outfile+"_centers.csv");
+    csvLimbs.open(outfile+"_limbs.csv");
+    csvFiducials.open(outfile+"_fiducials.csv");
+
+    for (unsigned int index = 0; index < results.size(); index++)
+    {
+        const AspectBatchResult &result = results[index];
+
+        // Generate CSV of center data
+        csvCenter << index << ";";
+        csvCenter << result.filename << ";";
+        csvCenter << (int) GetLegacyCode(result.runResult) << ";";
+        csvCenter << result.pixelCenter.x << ";" << result.pixelCenter.y << ";";
+        csvCenter << result.screenCenter.x << ";" << result.screenCenter.y << ";";
+        csvCenter << result.runTime << ";";
+        csvCenter << "\n";
+
+        // Generate CSV of limb data
+        csvLimbs << index << ";";
+        csvLimbs << result.filename << ";";
+        csvLimbs << result.limbCrossings.size() << ";";
+        for (unsigned int k = 0; k < result.limbCrossings.size(); k++)
+            csvLimbs << "[" << result.limbCrossings[k].x << " " << result.limbCrossings[k].y << "],";
+        csvLimbs << "\n";
+
+        // Generate CSV of fiducial data
+        csvFiducials << index << ";";
+        csvFiducials << result.filename << ";";
+        csvFiducials << result.pixelFiducials.size() << ";";
+        for (unsigned int k = 0; k < result.pixelFiducials.size(); k++)
+        {
+            csvFiducials << "[" << result.pixelFiducials[k].x << " " << result.pixelFiducials[k].y;
+            if (result.fiducialIDs.size() == result.pixelFiducials.size())
+                csvFiducials << " " << result.fiducialIDs[k].x << " " << result.fiducialIDs[k].y << "],";
+            else
+                csvFiducials << " -300 -300],";
+        }
+        csvFiducials << "\n";
+    }
+
+    csvCenter.close();
+    csvLimbs.close();
+    csvFiducials.close();
+    return 0;
+}
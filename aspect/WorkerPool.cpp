@@ -0,0 +1,126 @@
+#include "WorkerPool.hpp"
+#include <iostream>
+
+WorkerPool::WorkerPool(int numThreads)
+{
+    task = NULL;
+    arg = NULL;
+    count = next = pending = 0;
+    generation = 0;
+    stopping = false;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&workReady, NULL);
+    pthread_cond_init(&workDone, NULL);
+
+    for (int k = 1; k < numThreads; k++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, WorkerThread, this) != 0)
+        {
+            //Fewer threads only makes Run slower
+            std::cerr << "WorkerPool: could not start worker " << k << std::endl;
+            break;
+        }
+        threads.push_back(thread);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_broadcast(&workReady);
+    pthread_mutex_unlock(&mutex);
+
+    for (unsigned int k = 0; k < threads.size(); k++)
+        pthread_join(threads[k], NULL);
+
+    pthread_cond_destroy(&workDone);
+    pthread_cond_destroy(&workReady);
+    pthread_mutex_destroy(&mutex);
+}
+
+int WorkerPool::GetNumThreads()
+{
+    return threads.size() + 1;
+}
+
+void WorkerPool::Run(Task newTask, void *newArg, int newCount)
+{
+    if (newCount <= 0) return;
+
+    //Nothing to share out
+    if (threads.size() == 0 || newCount == 1)
+    {
+        for (int k = 0; k < newCount; k++)
+            newTask(newArg, k);
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    task = newTask;
+    arg = newArg;
+    count = newCount;
+    next = 0;
+    pending = newCount;
+    generation++;
+    pthread_cond_broadcast(&workReady);
+    pthread_mutex_unlock(&mutex);
+
+    RunIndices();
+
+    pthread_mutex_lock(&mutex);
+    while (pending > 0)
+        pthread_cond_wait(&workDone, &mutex);
+    task = NULL;
+    pthread_mutex_unlock(&mutex);
+}
+
+void *WorkerPool::WorkerThread(void *arg)
+{
+    ((WorkerPool *) arg)->Work();
+    return NULL;
+}
+
+void WorkerPool::Work()
+{
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&mutex);
+    while (true)
+    {
+        while (!stopping && generation == seen)
+            pthread_cond_wait(&workReady, &mutex);
+        if (stopping) break;
+        seen = generation;
+
+        pthread_mutex_unlock(&mutex);
+        RunIndices();
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void WorkerPool::RunIndices()
+{
+    int index, done = 0;
+    Task thisTask;
+    void *thisArg;
+
+    pthread_mutex_lock(&mutex);
+    thisTask = task;
+    thisArg = arg;
+    while (thisTask != NULL && next < count)
+    {
+        index = next++;
+        pthread_mutex_unlock(&mutex);
+        thisTask(thisArg, index);
+        done++;
+        pthread_mutex_lock(&mutex);
+    }
+    pending -= done;
+    if (done > 0 && pending == 0)
+        pthread_cond_signal(&workDone);
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,54 @@
+#ifndef _WORKERPOOL_HPP_
+#define _WORKERPOOL_HPP_
+
+/* WorkerPool is a small set of persistent threads for splitting one stage
+   of the Aspect pipeline across cores.
+
+   Run hands out the indices 0..count-1 of a task to the pool threads and
+   to the calling thread, and returns once every index has been done. Each
+   index should write only its own slot of the output, so the result is
+   the same no matter which thread did which index. The threads sleep
+   between calls, so keeping a pool around costs nothing while it's idle.
+*/
+
+#include <pthread.h>
+#include <vector>
+
+class WorkerPool
+{
+public:
+    typedef void (*Task)(void *arg, int index);
+
+    //numThreads counts the calling thread, so a pool of 1 starts no
+    //threads and runs everything in the caller
+    WorkerPool(int numThreads);
+    ~WorkerPool();
+
+    int GetNumThreads();
+
+    //Calls task(arg, index) for every index in [0, count)
+    void Run(Task task, void *arg, int count);
+
+private:
+    std::vector<pthread_t> threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t workReady, workDone;
+
+    //The job being run, protected by mutex
+    Task task;
+    void *arg;
+    int count, next, pending;
+    unsigned long generation;
+    bool stopping;
+
+    static void *WorkerThread(void *arg);
+    void Work();
+    void RunIndices();
+
+    //Not copyable
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+};
+
+#endif
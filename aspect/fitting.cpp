@@ -0,0 +1,100 @@
+#include "fitting.hpp"
+#include <cmath>
+
+//Relative size of a determinant below which the matrix is treated as singular
+#define SINGULAR_TOLERANCE 1e-12
+
+bool Solve2x2(const double A[2][2], const double b[2], double x[2], double *cond)
+{
+    double det = A[0][0]*A[1][1] - A[0][1]*A[1][0];
+    double scale = std::fabs(A[0][0]*A[1][1]) + std::fabs(A[0][1]*A[1][0]);
+
+    if (!std::isfinite(det) || std::fabs(det) <= SINGULAR_TOLERANCE*scale)
+        return false;
+
+    x[0] = (A[1][1]*b[0] - A[0][1]*b[1])/det;
+    x[1] = (A[0][0]*b[1] - A[1][0]*b[0])/det;
+
+    if (cond != NULL)
+    {
+        //Eigenvalues are the roots of l^2 - trace*l + det
+        double half = (A[0][0] + A[1][1])/2;
+        double root = std::sqrt(std::fabs(half*half - det));
+        double l1 = std::fabs(half + root), l2 = std::fabs(half - root);
+        *cond = (l1 > l2) ? l1/l2 : l2/l1;
+    }
+    return true;
+}
+
+bool Invert3x3(const double A[3][3], double inverse[3][3], double *det)
+{
+    double cofactor[3][3];
+    double d, scale;
+
+    //Cofactors (transposed) in a local, so inverse is untouched on failure
+    cofactor[0][0] = A[1][1]*A[2][2] - A[1][2]*A[2][1];
+    cofactor[0][1] = A[0][2]*A[2][1] - A[0][1]*A[2][2];
+    cofactor[0][2] = A[0][1]*A[1][2] - A[0][2]*A[1][1];
+    cofactor[1][0] = A[1][2]*A[2][0] - A[1][0]*A[2][2];
+    cofactor[1][1] = A[0][0]*A[2][2] - A[0][2]*A[2][0];
+    cofactor[1][2] = A[0][2]*A[1][0] - A[0][0]*A[1][2];
+    cofactor[2][0] = A[1][0]*A[2][1] - A[1][1]*A[2][0];
+    cofactor[2][1] = A[0][1]*A[2][0] - A[0][0]*A[2][1];
+    cofactor[2][2] = A[0][0]*A[1][1] - A[0][1]*A[1][0];
+    d = A[0][0]*cofactor[0][0] + A[0][1]*cofactor[1][0] + A[0][2]*cofactor[2][0];
+    if (det != NULL) *det = d;
+
+    //Compare against the size of the terms that make up the determinant
+    scale = std::fabs(A[0][0]*cofactor[0][0]) + std::fabs(A[0][1]*cofactor[1][0]) +
+        std::fabs(A[0][2]*cofactor[2][0]);
+    if (!std::isfinite(d) || std::fabs(d) <= SINGULAR_TOLERANCE*scale)
+        return false;
+
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            inverse[i][j] = cofactor[i][j]/d;
+    return true;
+}
+
+//Largest absolute column sum
+static double Norm1(const double A[3][3])
+{
+    double norm = 0;
+    for (int j = 0; j < 3; j++)
+    {
+        double sum = std::fabs(A[0][j]) + std::fabs(A[1][j]) + std::fabs(A[2][j]);
+        if (sum > norm) norm = sum;
+    }
+    return norm;
+}
+
+bool Solve3x3(const double A[3][3], const double b[3], double x[3], double *cond)
+{
+    double inverse[3][3];
+
+    if (!Invert3x3(A, inverse))
+        return false;
+
+    for (int i = 0; i < 3; i++)
+        x[i] = inverse[i][0]*b[0] + inverse[i][1]*b[1] + inverse[i][2]*b[2];
+
+    if (cond != NULL)
+        *cond = Norm1(A)*Norm1(inverse);
+    return true;
+}
+
+bool LineAccumulator::Solve(float &intercept, float &slope, float *cond)
+{
+    //Normal equations for [slope intercept]
+    double A[2][2] = {{sxx, sx}, {sx, n}};
+    double b[2] = {sxy, sy};
+    double x[2], c;
+
+    if (!Solve2x2(A, b, x, (cond != NULL) ? &c : NULL))
+        return false;
+
+    slope = x[0];
+    intercept = x[1];
+    if (cond != NULL) *cond = c;
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef _FITTING_HPP_
+#define _FITTING_HPP_
+
+#include <cstddef>
+
+/* Small fixed-size least squares and linear solvers.
+
+   Everything here works on stack arrays and closed form expressions, so the
+   per-edge and per-frame fits in the Aspect pipeline never touch the heap.
+   Matrices are row major. The optional condition numbers are left alone
+   when the pointer is NULL.
+*/
+
+//Solves A*x = b for a 2x2 A. Returns false if A is singular. cond receives
+//the ratio of the largest to smallest eigenvalue magnitude, which is the
+//2-norm condition number when A is symmetric (e.g. normal equations).
+bool Solve2x2(const double A[2][2], const double b[2], double x[2], double *cond = NULL);
+
+//Inverts a 3x3 A from its cofactors. Returns false, leaving inverse as it
+//was, if A is singular.
+//det receives the determinant.
+bool Invert3x3(const double A[3][3], double inverse[3][3], double *det = NULL);
+
+//Solves A*x = b for a 3x3 A. Returns false if A is singular. cond receives
+//the 1-norm condition number ||A|| ||inv(A)||.
+bool Solve3x3(const double A[3][3], const double b[3], double x[3], double *cond = NULL);
+
+//Straight line least squares fit, y = intercept + slope*x, accumulated one
+//point at a time.
+class LineAccumulator
+{
+public:
+    LineAccumulator() { Reset(); }
+    void Reset() { n = sx = sxx = sy = sxy = 0; }
+    void Add(double x, double y)
+    {
+        n += 1;
+        sx += x;
+        sxx += x*x;
+        sy += y;
+        sxy += x*y;
+    }
+    int Count() { return (int) n; }
+
+    //Returns false if the points don't determine a line
+    bool Solve(float &intercept, float &slope, float *cond = NULL);
+
+private:
+    double n, sx, sxx, sy, sxy;
+};
+
+#endif
@@ -0,0 +1,679 @@
+#include "pixelops.hpp"
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+//Decodes a bitmask of transitions for the block of pixels starting at start.
+//above holds one bit per pixel that is above threshold.
+static inline void StoreCrossings(unsigned int transitions, unsigned int above, int start,
+                                  int *edges, int capacity, int &count)
+{
+    while (transitions)
+    {
+        int bit = __builtin_ctz(transitions);
+        transitions &= transitions - 1;
+        if (count < capacity)
+        {
+            //check for a rising edge, save the index above the threshold
+            if (above & (1u << bit))
+                edges[count] = start + bit;
+            //otherwise a falling edge, save the last index above the threshold
+            else
+                edges[count] = -(start + bit - 1);
+        }
+        count++;
+    }
+}
+
+//SIMD scan of the start of a line for FindThresholdCrossings. Each overload
+//handles whole blocks of pixels, updating the crossing count, the state of
+//the last pixel and the running maximum, and returns where it stopped.
+static int CrossingsSIMD(const unsigned char *pixels, int length, unsigned char threshold,
+                         int *edges, int capacity, int &count,
+                         unsigned int &lastAbove, unsigned char &pixelMax)
+{
+    int k = 0;
+
+#ifdef __AVX2__
+    {
+        const __m256i bias = _mm256_set1_epi8((char) 0x80);
+        const __m256i limit = _mm256_set1_epi8((char) (threshold ^ 0x80));
+        __m256i vmax = _mm256_setzero_si256();
+        for (; k + 32 <= length; k += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (pixels + k));
+            vmax = _mm256_max_epu8(vmax, v);
+            //unsigned compare via the signed compare on biased values
+            unsigned int above = (unsigned int) _mm256_movemask_epi8(
+                _mm256_cmpgt_epi8(_mm256_xor_si256(v, bias), limit));
+            unsigned int transitions = above ^ ((above << 1) | lastAbove);
+            StoreCrossings(transitions, above, k, edges, capacity, count);
+            lastAbove = above >> 31;
+        }
+        unsigned char lanes[32];
+        _mm256_storeu_si256((__m256i *) lanes, vmax);
+        for (int l = 0; l < 32; l++)
+            if (lanes[l] > pixelMax) pixelMax = lanes[l];
+    }
+#endif
+
+#ifdef __SSE2__
+    {
+        const __m128i bias = _mm_set1_epi8((char) 0x80);
+        const __m128i limit = _mm_set1_epi8((char) (threshold ^ 0x80));
+        __m128i vmax = _mm_setzero_si128();
+        for (; k + 16 <= length; k += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *) (pixels + k));
+            vmax = _mm_max_epu8(vmax, v);
+            unsigned int above = (unsigned int) _mm_movemask_epi8(
+                _mm_cmpgt_epi8(_mm_xor_si128(v, bias), limit));
+            unsigned int transitions = (above ^ ((above << 1) | lastAbove)) & 0xFFFF;
+            StoreCrossings(transitions, above, k, edges, capacity, count);
+            lastAbove = (above >> 15) & 1;
+        }
+        unsigned char lanes[16];
+        _mm_storeu_si128((__m128i *) lanes, vmax);
+        for (int l = 0; l < 16; l++)
+            if (lanes[l] > pixelMax) pixelMax = lanes[l];
+    }
+#endif
+
+    return k;
+}
+
+static int CrossingsSIMD(const unsigned short *pixels, int length, unsigned short threshold,
+                         int *edges, int capacity, int &count,
+                         unsigned int &lastAbove, unsigned short &pixelMax)
+{
+    int k = 0;
+
+#ifdef __SSE2__
+    {
+        //SSE2 has no unsigned 16-bit compare or max, so both work on values
+        //biased into the signed range
+        const __m128i bias = _mm_set1_epi16((short) 0x8000);
+        const __m128i limit = _mm_set1_epi16((short) (threshold ^ 0x8000));
+        __m128i vmax = _mm_set1_epi16((short) 0x8000);
+        for (; k + 8 <= length; k += 8)
+        {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (pixels + k)), bias);
+            vmax = _mm_max_epi16(vmax, v);
+            __m128i mask = _mm_cmpgt_epi16(v, limit);
+            unsigned int above = (unsigned int) _mm_movemask_epi8(
+                _mm_packs_epi16(mask, _mm_setzero_si128())) & 0xFF;
+            unsigned int transitions = (above ^ ((above << 1) | lastAbove)) & 0xFF;
+            StoreCrossings(transitions, above, k, edges, capacity, count);
+            lastAbove = (above >> 7) & 1;
+        }
+        unsigned short lanes[8];
+        _mm_storeu_si128((__m128i *) lanes, _mm_xor_si128(vmax, bias));
+        for (int l = 0; l < 8; l++)
+            if (lanes[l] > pixelMax) pixelMax = lanes[l];
+    }
+#endif
+
+    return k;
+}
+
+template <typename Pixel>
+int FindThresholdCrossings(const Pixel *pixels, int length,
+                           Pixel threshold,
+                           int *edges, int capacity,
+                           Pixel &maxValue)
+{
+    int count = 0;
+    int k = 0;
+    Pixel pixelMax;
+    unsigned int lastAbove;
+
+    if (length <= 0)
+    {
+        maxValue = 0;
+        return 0;
+    }
+
+    pixelMax = pixels[0];
+    //The first pixel has no predecessor, so it can never be a crossing
+    lastAbove = (pixels[0] > threshold) ? 1 : 0;
+
+    k = CrossingsSIMD(pixels, length, threshold, edges, capacity, count, lastAbove, pixelMax);
+
+    //Scalar tail (or the whole line without SIMD)
+    for (; k < length; k++)
+    {
+        Pixel thisValue = pixels[k];
+        unsigned int above = (thisValue > threshold) ? 1 : 0;
+        if (thisValue > pixelMax)
+            pixelMax = thisValue;
+        if (above != lastAbove)
+            StoreCrossings(1, above, k, edges, capacity, count);
+        lastAbove = above;
+    }
+
+    maxValue = pixelMax;
+    return count;
+}
+
+template int FindThresholdCrossings(const unsigned char *, int, unsigned char,
+                                    int *, int, unsigned char &);
+template int FindThresholdCrossings(const unsigned short *, int, unsigned short,
+                                    int *, int, unsigned short &);
+
+template <typename Pixel>
+void GatherChords(const Pixel *image, int rows, int cols, size_t step,
+                  const int *rowList, int numRows,
+                  const int *colList, int numCols,
+                  Pixel *buffer)
+{
+    const unsigned char *bytes = (const unsigned char *) image;
+    Pixel *colBuffer = buffer + (size_t) numRows*cols;
+
+    for (int k = 0; k < numRows; k++)
+        memcpy(buffer + (size_t) k*cols, bytes + (size_t) rowList[k]*step, cols*sizeof(Pixel));
+
+    //Reading a column directly walks the image once per column. Instead
+    //walk it once, row by row, picking every requested column out of each
+    //row. There are only a few column chords, so their write positions
+    //stay in cache.
+    for (int m = 0; m < rows; m++)
+    {
+        const Pixel *src = (const Pixel *) (bytes + (size_t) m*step);
+        Pixel *dst = colBuffer + m;
+        for (int k = 0; k < numCols; k++)
+            dst[(size_t) k*rows] = src[colList[k]];
+    }
+}
+
+template void GatherChords(const unsigned char *, int, int, size_t, const int *, int,
+                           const int *, int, unsigned char *);
+template void GatherChords(const unsigned short *, int, int, size_t, const int *, int,
+                           const int *, int, unsigned short *);
+
+template <typename Pixel>
+void AccumulateHistogram(const Pixel *image, int rows, int cols, size_t step,
+                         int rowStep, int colStep, unsigned int *hist)
+{
+    const int shift = 8*(sizeof(Pixel) - 1);
+    unsigned int sub[4][256];
+    memset(sub, 0, sizeof(sub));
+
+    if (rowStep < 1) rowStep = 1;
+    if (colStep < 1) colStep = 1;
+
+    for (int m = 0; m < rows; m += rowStep)
+    {
+        const Pixel *src = (const Pixel *) ((const unsigned char *) image + (size_t) m*step);
+        for (int n = 0; n < cols; n += colStep)
+            sub[n & 3][(src[n] >> shift) & 0xFF]++;
+    }
+
+    for (int j = 0; j < 256; j++)
+        hist[j] += sub[0][j] + sub[1][j] + sub[2][j] + sub[3][j];
+}
+
+template <>
+void AccumulateHistogram(const unsigned char *image, int rows, int cols, size_t step,
+                         int rowStep, int colStep, unsigned int *hist)
+{
+    //Four interleaved sub-histograms, so that runs of equal pixel values
+    //(e.g. dark sky, saturated disk) don't serialize on one counter
+    unsigned int sub[4][256];
+    memset(sub, 0, sizeof(sub));
+
+    if (rowStep < 1) rowStep = 1;
+    if (colStep < 1) colStep = 1;
+
+    for (int m = 0; m < rows; m += rowStep)
+    {
+        const unsigned char *src = image + (size_t) m*step;
+        int n = 0;
+        if (colStep == 1)
+        {
+            //Read eight pixels per load and peel them off in registers
+            for (; n + 8 <= cols; n += 8)
+            {
+                uint32_t lo, hi;
+                memcpy(&lo, src + n, 4);
+                memcpy(&hi, src + n + 4, 4);
+                sub[0][lo & 0xFF]++;
+                sub[1][(lo >> 8) & 0xFF]++;
+                sub[2][(lo >> 16) & 0xFF]++;
+                sub[3][lo >> 24]++;
+                sub[0][hi & 0xFF]++;
+                sub[1][(hi >> 8) & 0xFF]++;
+                sub[2][(hi >> 16) & 0xFF]++;
+                sub[3][hi >> 24]++;
+            }
+        }
+        for (; n < cols; n += colStep)
+            sub[n & 3][src[n]]++;
+    }
+
+    for (int j = 0; j < 256; j++)
+        hist[j] += sub[0][j] + sub[1][j] + sub[2][j] + sub[3][j];
+}
+
+template void AccumulateHistogram(const unsigned short *, int, int, size_t,
+                                  int, int, unsigned int *);
+
+void AccumulateBucketHistograms(const unsigned short *image, int rows, int cols, size_t step,
+                                int rowStep, int colStep,
+                                unsigned int lowBucket, unsigned int *lowHist,
+                                unsigned int highBucket, unsigned int *highHist)
+{
+    if (rowStep < 1) rowStep = 1;
+    if (colStep < 1) colStep = 1;
+
+    for (int m = 0; m < rows; m += rowStep)
+    {
+        const unsigned short *src = (const unsigned short *) ((const unsigned char *) image + (size_t) m*step);
+        for (int n = 0; n < cols; n += colStep)
+        {
+            unsigned int bucket = src[n] >> 8;
+            if (bucket == lowBucket)
+                lowHist[src[n] & 0xFF]++;
+            else if (bucket == highBucket)
+                highHist[src[n] & 0xFF]++;
+        }
+    }
+}
+
+//Most kernel columns CorrelateKernel16 handles; twice the default fiducial kernel
+#define MAX_KERNEL_COLS 64
+
+void CorrelateKernel16(const unsigned char *image, int rows, int cols, size_t step,
+                       unsigned char clampValue,
+                       const short *kernel, int kRows, int kCols, float scale,
+                       float *output, size_t outStep)
+{
+    int outRows = rows - kRows + 1;
+    int outCols = cols - kCols + 1;
+    float invScale = 1.0f/scale;
+    if (outRows <= 0 || outCols <= 0) return;
+
+#ifdef __SSE2__
+    //Taps are taken two at a time, (j, j+1), so one _mm_madd_epi16 of the
+    //interleaved pixels against (k[j], k[j+1]) adds both to four outputs.
+    //An odd last tap is paired with a zero weight.
+    int kPairs = (kCols + 1)/2;
+    int pairWeights[MAX_KERNEL_COLS/2*MAX_KERNEL_COLS];
+    bool useSIMD = (kCols <= MAX_KERNEL_COLS && kRows <= MAX_KERNEL_COLS);
+    if (useSIMD)
+    {
+        for (int i = 0; i < kRows; i++)
+            for (int p = 0; p < kPairs; p++)
+            {
+                unsigned short lo = (unsigned short) kernel[i*kCols + 2*p];
+                unsigned short hi = (2*p + 1 < kCols) ? (unsigned short) kernel[i*kCols + 2*p + 1] : 0;
+                pairWeights[i*kPairs + p] = (int) (lo | ((unsigned int) hi << 16));
+            }
+    }
+#endif
+
+    for (int y = 0; y < outRows; y++)
+    {
+        float *dst = output + (size_t) y*outStep;
+        int x = 0;
+
+#ifdef __AVX2__
+        if (useSIMD)
+        {
+            const __m128i clamp = _mm_set1_epi8((char) clampValue);
+            const __m256 scaleV = _mm256_set1_ps(invScale);
+            for (; x + 16 <= outCols; x += 16)
+            {
+                __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+                for (int i = 0; i < kRows; i++)
+                {
+                    const unsigned char *src = image + (size_t) (y + i)*step + x;
+                    for (int p = 0; p < kPairs; p++)
+                    {
+                        __m256i a = _mm256_cvtepu8_epi16(_mm_min_epu8(
+                            _mm_loadu_si128((const __m128i *) (src + 2*p)), clamp));
+                        __m256i b = (2*p + 1 < kCols) ? _mm256_cvtepu8_epi16(_mm_min_epu8(
+                            _mm_loadu_si128((const __m128i *) (src + 2*p + 1)), clamp))
+                            : _mm256_setzero_si256();
+                        __m256i w = _mm256_set1_epi32(pairWeights[i*kPairs + p]);
+                        //per 128-bit lane: acc0 gets outputs 0-3 | 8-11, acc1 4-7 | 12-15
+                        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+                        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+                    }
+                }
+                _mm256_storeu_ps(dst + x, _mm256_mul_ps(_mm256_cvtepi32_ps(
+                    _mm256_permute2x128_si256(acc0, acc1, 0x20)), scaleV));
+                _mm256_storeu_ps(dst + x + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(
+                    _mm256_permute2x128_si256(acc0, acc1, 0x31)), scaleV));
+            }
+        }
+#endif
+
+#ifdef __SSE2__
+        if (useSIMD)
+        {
+            const __m128i clamp = _mm_set1_epi8((char) clampValue);
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 scaleV = _mm_set1_ps(invScale);
+            //8-byte loads at x + j must stay inside the row
+            for (; x + 8 <= outCols; x += 8)
+            {
+                __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+                for (int i = 0; i < kRows; i++)
+                {
+                    const unsigned char *src = image + (size_t) (y + i)*step + x;
+                    for (int p = 0; p < kPairs; p++)
+                    {
+                        __m128i a = _mm_unpacklo_epi8(_mm_min_epu8(
+                            _mm_loadl_epi64((const __m128i *) (src + 2*p)), clamp), zero);
+                        __m128i b = (2*p + 1 < kCols) ? _mm_unpacklo_epi8(_mm_min_epu8(
+                            _mm_loadl_epi64((const __m128i *) (src + 2*p + 1)), clamp), zero)
+                            : zero;
+                        __m128i w = _mm_set1_epi32(pairWeights[i*kPairs + p]);
+                        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+                        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+                    }
+                }
+                _mm_storeu_ps(dst + x, _mm_mul_ps(_mm_cvtepi32_ps(acc0), scaleV));
+                _mm_storeu_ps(dst + x + 4, _mm_mul_ps(_mm_cvtepi32_ps(acc1), scaleV));
+            }
+        }
+#endif
+
+        //Scalar tail (or the whole row without SIMD)
+        for (; x < outCols; x++)
+        {
+            int acc = 0;
+            for (int i = 0; i < kRows; i++)
+            {
+                const unsigned char *src = image + (size_t) (y + i)*step + x;
+                const short *k = kernel + i*kCols;
+                for (int j = 0; j < kCols; j++)
+                {
+                    int pixel = (src[j] < clampValue) ? src[j] : clampValue;
+                    acc += pixel*k[j];
+                }
+            }
+            dst[x] = (float) acc*invScale;
+        }
+    }
+}
+
+//Peaks are fitted this many at a time, so the profiles fit on the stack
+#define FIT_BLOCK 32
+
+//Vertex of the parabola through (-1,l), (0,c), (1,r), clamped to +-1. A
+//profile that doesn't curve downwards gives 0.
+static inline float ParabolaVertex(float l, float c, float r)
+{
+    float curvature = l - 2*c + r;
+    if (!(curvature < 0)) return 0;
+    float vertex = 0.5f*(l - r)/curvature;
+    if (vertex > 1) vertex = 1;
+    if (vertex < -1) vertex = -1;
+    return vertex;
+}
+
+#ifdef __SSE2__
+static inline __m128 ParabolaVertex4(__m128 l, __m128 c, __m128 r)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    __m128 curvature = _mm_sub_ps(_mm_add_ps(l, r), _mm_add_ps(c, c));
+    __m128 curved = _mm_cmplt_ps(curvature, zero);
+    __m128 vertex = _mm_div_ps(_mm_mul_ps(half, _mm_sub_ps(l, r)), curvature);
+    vertex = _mm_min_ps(_mm_max_ps(vertex, _mm_sub_ps(zero, one)), one);
+    return _mm_and_ps(vertex, curved);
+}
+#endif
+
+void FitPeaks3x3(const float *image, int rows, int cols, size_t step,
+                 const int *peakRows, const int *peakCols, int count,
+                 bool logarithm, float *dx, float *dy)
+{
+    float xl[FIT_BLOCK], xc[FIT_BLOCK], xr[FIT_BLOCK];
+    float yl[FIT_BLOCK], yc[FIT_BLOCK], yr[FIT_BLOCK];
+
+    for (int start = 0; start < count; start += FIT_BLOCK)
+    {
+        int block = (count - start < FIT_BLOCK) ? count - start : FIT_BLOCK;
+
+        //Gather the row and column profiles of each neighborhood
+        for (int k = 0; k < block; k++)
+        {
+            int m = peakRows[start + k], n = peakCols[start + k];
+            if (m < 1 || m > rows - 2 || n < 1 || n > cols - 2)
+            {
+                //No neighborhood on the border: a flat profile fits to 0
+                xl[k] = xc[k] = xr[k] = yl[k] = yc[k] = yr[k] = 0;
+                continue;
+            }
+            const float *up = image + (size_t) (m - 1)*step + n;
+            const float *mid = up + step;
+            const float *down = mid + step;
+            xl[k] = up[-1] + mid[-1] + down[-1];
+            xc[k] = up[0] + mid[0] + down[0];
+            xr[k] = up[1] + mid[1] + down[1];
+            yl[k] = up[-1] + up[0] + up[1];
+            yc[k] = mid[-1] + mid[0] + mid[1];
+            yr[k] = down[-1] + down[0] + down[1];
+
+            //A Gaussian is a parabola in log space, but only where the
+            //profile is positive. Otherwise that axis keeps the plain fit.
+            if (logarithm)
+            {
+                if (xl[k] > 0 && xc[k] > 0 && xr[k] > 0)
+                {
+                    xl[k] = std::log(xl[k]); xc[k] = std::log(xc[k]); xr[k] = std::log(xr[k]);
+                }
+                if (yl[k] > 0 && yc[k] > 0 && yr[k] > 0)
+                {
+                    yl[k] = std::log(yl[k]); yc[k] = std::log(yc[k]); yr[k] = std::log(yr[k]);
+                }
+            }
+        }
+
+        int k = 0;
+#ifdef __SSE2__
+        for (; k + 4 <= block; k += 4)
+        {
+            _mm_storeu_ps(dx + start + k, ParabolaVertex4(_mm_loadu_ps(xl + k),
+                                                          _mm_loadu_ps(xc + k),
+                                                          _mm_loadu_ps(xr + k)));
+            _mm_storeu_ps(dy + start + k, ParabolaVertex4(_mm_loadu_ps(yl + k),
+                                                          _mm_loadu_ps(yc + k),
+                                                          _mm_loadu_ps(yr + k)));
+        }
+#endif
+        for (; k < block; k++)
+        {
+            dx[start + k] = ParabolaVertex(xl[k], xc[k], xr[k]);
+            dy[start + k] = ParabolaVertex(yl[k], yc[k], yr[k]);
+        }
+    }
+}
+
+template <typename Pixel>
+void Downsample2x(const Pixel *src, int rows, int cols, size_t srcStep,
+                  Pixel *dst, size_t dstStep)
+{
+    int outRows = rows/2, outCols = cols/2;
+
+    for (int y = 0; y < outRows; y++)
+    {
+        const Pixel *top = (const Pixel *) ((const unsigned char *) src + (size_t) (2*y)*srcStep);
+        const Pixel *bottom = (const Pixel *) ((const unsigned char *) top + srcStep);
+        Pixel *out = (Pixel *) ((unsigned char *) dst + (size_t) y*dstStep);
+        for (int x = 0; x < outCols; x++)
+        {
+            unsigned int left = (top[2*x] + bottom[2*x] + 1) >> 1;
+            unsigned int right = (top[2*x + 1] + bottom[2*x + 1] + 1) >> 1;
+            out[x] = (Pixel) ((left + right + 1) >> 1);
+        }
+    }
+}
+
+template <>
+void Downsample2x(const unsigned char *src, int rows, int cols, size_t srcStep,
+                  unsigned char *dst, size_t dstStep)
+{
+    int outRows = rows/2, outCols = cols/2;
+
+    for (int y = 0; y < outRows; y++)
+    {
+        const unsigned char *top = src + (size_t) (2*y)*srcStep;
+        const unsigned char *bottom = top + srcStep;
+        unsigned char *out = dst + (size_t) y*dstStep;
+        int x = 0;
+
+#ifdef __SSE2__
+        {
+            const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+            for (; x + 16 <= outCols; x += 16)
+            {
+                //Average the row pair, then each horizontal pair of those
+                __m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *) (top + 2*x)),
+                                          _mm_loadu_si128((const __m128i *) (bottom + 2*x)));
+                __m128i v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *) (top + 2*x + 16)),
+                                          _mm_loadu_si128((const __m128i *) (bottom + 2*x + 16)));
+                __m128i h0 = _mm_avg_epu16(_mm_and_si128(v0, lowBytes), _mm_srli_epi16(v0, 8));
+                __m128i h1 = _mm_avg_epu16(_mm_and_si128(v1, lowBytes), _mm_srli_epi16(v1, 8));
+                _mm_storeu_si128((__m128i *) (out + x), _mm_packus_epi16(h0, h1));
+            }
+        }
+#endif
+
+        //Scalar tail (or the whole row without SIMD), rounding the same way
+        for (; x < outCols; x++)
+        {
+            unsigned int left = (top[2*x] + bottom[2*x] + 1) >> 1;
+            unsigned int right = (top[2*x + 1] + bottom[2*x + 1] + 1) >> 1;
+            out[x] = (unsigned char) ((left + right + 1) >> 1);
+        }
+    }
+}
+
+template void Downsample2x(const unsigned short *, int, int, size_t, unsigned short *, size_t);
+
+//SIMD part of a row for ThresholdMoments. Each overload handles whole blocks
+//of pixels from the start of the row, and returns where it stopped.
+static int MomentsSIMD(const unsigned char *pixels, int cols, unsigned char threshold,
+                       long long &rowCount, long long &rowSum)
+{
+    int n = 0;
+    rowCount = rowSum = 0;
+
+#ifdef __SSE2__
+    {
+        const __m128i bias = _mm_set1_epi8((char) 0x80);
+        const __m128i limit = _mm_set1_epi8((char) (threshold ^ 0x80));
+        const __m128i ones = _mm_set1_epi8(1);
+        const __m128i lanes = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                            8, 9, 10, 11, 12, 13, 14, 15);
+        const __m128i zero = _mm_setzero_si128();
+        //Over blocks b of 16 pixels, counts sums cnt[b] and lanesum the
+        //lane positions. running adds up counts after every block,
+        //which comes to sum (blocks - b)*cnt[b], so the block offsets
+        //need no multiplies.
+        __m128i counts = zero, running = zero, lanesum = zero;
+        int blocks = 0;
+        for (; n + 16 <= cols; n += 16, blocks++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *) (pixels + n));
+            __m128i above = _mm_cmpgt_epi8(_mm_xor_si128(v, bias), limit);
+            counts = _mm_add_epi64(counts, _mm_sad_epu8(_mm_and_si128(above, ones), zero));
+            lanesum = _mm_add_epi64(lanesum, _mm_sad_epu8(_mm_and_si128(above, lanes), zero));
+            running = _mm_add_epi64(running, counts);
+        }
+        long long c[2], r[2], l[2];
+        _mm_storeu_si128((__m128i *) c, counts);
+        _mm_storeu_si128((__m128i *) r, running);
+        _mm_storeu_si128((__m128i *) l, lanesum);
+        rowCount = c[0] + c[1];
+        //sum b*cnt[b] = blocks*sum cnt[b] - sum (blocks - b)*cnt[b]
+        rowSum = 16*(blocks*rowCount - (r[0] + r[1])) + l[0] + l[1];
+    }
+#endif
+
+    return n;
+}
+
+static int MomentsSIMD(const unsigned short *pixels, int cols, unsigned short threshold,
+                       long long &rowCount, long long &rowSum)
+{
+    int n = 0;
+    rowCount = rowSum = 0;
+
+#ifdef __SSE2__
+    {
+        //The same running sum as the 8-bit version, eight pixels at a time,
+        //with pmaddwd doing the horizontal adds into 32-bit lanes. running
+        //stays below 2*blocks^2 per lane, so rows up to 2^18 pixels fit.
+        const __m128i bias = _mm_set1_epi16((short) 0x8000);
+        const __m128i limit = _mm_set1_epi16((short) (threshold ^ 0x8000));
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i lanes = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i counts = zero, running = zero, lanesum = zero;
+        int blocks = 0;
+        for (; n + 8 <= cols; n += 8, blocks++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *) (pixels + n));
+            __m128i above = _mm_and_si128(_mm_cmpgt_epi16(_mm_xor_si128(v, bias), limit), ones);
+            counts = _mm_add_epi32(counts, _mm_madd_epi16(above, ones));
+            lanesum = _mm_add_epi32(lanesum, _mm_madd_epi16(above, lanes));
+            running = _mm_add_epi32(running, counts);
+        }
+        int c[4], r[4], l[4];
+        _mm_storeu_si128((__m128i *) c, counts);
+        _mm_storeu_si128((__m128i *) r, running);
+        _mm_storeu_si128((__m128i *) l, lanesum);
+        rowCount = (long long) c[0] + c[1] + c[2] + c[3];
+        rowSum = 8*(blocks*rowCount - ((long long) r[0] + r[1] + r[2] + r[3]))
+            + l[0] + l[1] + l[2] + l[3];
+    }
+#endif
+
+    return n;
+}
+
+template <typename Pixel>
+void ThresholdMoments(const Pixel *image, int rows, int cols, size_t step,
+                      Pixel threshold,
+                      long long &count, long long &sumCol, long long &sumRow)
+{
+    count = sumCol = sumRow = 0;
+
+    for (int m = 0; m < rows; m++)
+    {
+        const Pixel *pixels = (const Pixel *) ((const unsigned char *) image + (size_t) m*step);
+        long long rowCount, rowSum;
+        int n = MomentsSIMD(pixels, cols, threshold, rowCount, rowSum);
+
+        //Scalar tail (or the whole row without SIMD)
+        for (; n < cols; n++)
+        {
+            if (pixels[n] > threshold)
+            {
+                rowCount++;
+                rowSum += n;
+            }
+        }
+
+        count += rowCount;
+        sumCol += rowSum;
+        sumRow += rowCount*m;
+    }
+}
+
+template void ThresholdMoments(const unsigned char *, int, int, size_t, unsigned char,
+                               long long &, long long &, long long &);
+template void ThresholdMoments(const unsigned short *, int, int, size_t, unsigned short,
+                               long long &, long long &, long long &);
@@ -0,0 +1,101 @@
+#ifndef _PIXELOPS_HPP_
+#define _PIXELOPS_HPP_
+
+#include <cstddef>
+
+/* Low-level pixel loops used by the Aspect pipeline.
+
+   These work on raw pixel pointers rather than cv::Mat so they can be
+   vectorized. Where SIMD helps, a routine has SSE2 and/or AVX2 paths,
+   selected at compile time from the target flags (__SSE2__, __AVX2__), and
+   a scalar fallback that gives identical results.
+
+   Routines that read camera pixels are templates on the pixel type, and
+   are instantiated for 8-bit (unsigned char) and 10/12-bit (unsigned short)
+   frames. step is always the row stride in bytes.
+*/
+
+//Finds every crossing of a threshold along a contiguous line of pixels.
+//   A rising edge is stored as the index of the first pixel above threshold,
+//   a falling edge as minus the index of the last pixel above threshold.
+//   At most capacity edges are written to edges, but all crossings are
+//   counted, so a return value larger than capacity means the buffer
+//   overflowed. maxValue receives the brightest pixel in the line.
+template <typename Pixel>
+int FindThresholdCrossings(const Pixel *pixels, int length,
+                           Pixel threshold,
+                           int *edges, int capacity,
+                           Pixel &maxValue);
+
+//Packs the chords along the listed rows and columns of an image into one
+//contiguous buffer, so every chord can be scanned at full bandwidth.
+//   The buffer holds numRows row chords of length cols, followed by numCols
+//   column chords of length rows, and must have room for
+//   numRows*cols + numCols*rows pixels.
+template <typename Pixel>
+void GatherChords(const Pixel *image, int rows, int cols, size_t step,
+                  const int *rowList, int numRows,
+                  const int *colList, int numCols,
+                  Pixel *buffer);
+
+//Adds the pixels of an image, taking every rowStep-th row and every
+//colStep-th column, to a 256-bin histogram of their high bytes (the whole
+//pixel for 8-bit images). hist is not cleared first.
+template <typename Pixel>
+void AccumulateHistogram(const Pixel *image, int rows, int cols, size_t step,
+                         int rowStep, int colStep, unsigned int *hist);
+//8-bit images have their own unrolled, multi-table version
+template <>
+void AccumulateHistogram(const unsigned char *image, int rows, int cols, size_t step,
+                         int rowStep, int colStep, unsigned int *hist);
+
+//Second pass of a radix histogram of a 16-bit image: of the same pixels as
+//AccumulateHistogram, those whose high byte is lowBucket are added to
+//lowHist and those whose high byte is highBucket to highHist, binned by
+//their low bytes. If the buckets are the same only lowHist is used.
+void AccumulateBucketHistograms(const unsigned short *image, int rows, int cols, size_t step,
+                                int rowStep, int colStep,
+                                unsigned int lowBucket, unsigned int *lowHist,
+                                unsigned int highBucket, unsigned int *highHist);
+
+//Correlates an 8-bit image with an integer kernel, like matchTemplate with
+//CV_TM_CCORR: output is (rows-kRows+1) x (cols-kCols+1) floats, outStep
+//floats apart. Pixels are clamped to clampValue as they are read. Sums are
+//exact in int32 and scaled by 1/scale on output, so kernel*scale*255*kRows*kCols
+//must fit in an int32.
+void CorrelateKernel16(const unsigned char *image, int rows, int cols, size_t step,
+                       unsigned char clampValue,
+                       const short *kernel, int kRows, int kCols, float scale,
+                       float *output, size_t outStep);
+
+//Sub-pixel offsets of count peaks in a float image, all fitted together.
+//   Each peak's 3x3 neighborhood is summed into a row and a column profile,
+//   and a parabola through each profile gives the offset (dx, dy) of the
+//   peak from (peakCols[k], peakRows[k]), clamped to +-1 pixel. With
+//   logarithm set the parabolas go through the log of the profiles, which is
+//   exact for a Gaussian peak. step is the image row stride in floats. Peaks
+//   on the image border get offsets of 0.
+void FitPeaks3x3(const float *image, int rows, int cols, size_t step,
+                 const int *peakRows, const int *peakCols, int count,
+                 bool logarithm, float *dx, float *dy);
+
+//Halves an image in each dimension for a coarse pyramid level. Each output
+//pixel is the mean of a 2x2 block, taken as the rounded mean of the rounded
+//means of its columns (which is how the SIMD average rounds). The output is
+//rows/2 x cols/2, dstStep bytes per row.
+template <typename Pixel>
+void Downsample2x(const Pixel *src, int rows, int cols, size_t srcStep,
+                  Pixel *dst, size_t dstStep);
+//8-bit images have their own SIMD version
+template <>
+void Downsample2x(const unsigned char *src, int rows, int cols, size_t srcStep,
+                  unsigned char *dst, size_t dstStep);
+
+//Zeroth and first moments of the pixels of an image above threshold: their
+//count and the sums of their column and row indices.
+template <typename Pixel>
+void ThresholdMoments(const Pixel *image, int rows, int cols, size_t step,
+                      Pixel threshold,
+                      long long &count, long long &sumCol, long long &sumRow);
+
+#endif
@@ -9,14 +9,82 @@
 */
 #include "processing.hpp"
 #include "utilities.hpp"
+#include "pixelops.hpp"
+#include "fitting.hpp"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <list>
+#include <algorithm>
+#include <unistd.h>
 #include <cmath>
+#include <cstdio>
+#include <limits>
 
 const float pi = std::atan(1.0)*4;
 
+//Most crossings a single chord may have before it is rejected as noise
+#define MAX_LIMB_EDGES 64
+
+//Kernel factors with singular values below this fraction of the largest
+//are numerical noise
+#define KERNEL_RANK_EPSILON 1e-4
+
+//Fixed-point scale of the quantized kernel used by CORRELATION_INTEGER.
+//Kernel values are in [-1, 1], so this leaves int32 room for 255*scale
+//summed over kernels up to about 90x90.
+#define KERNEL_SCALE 1024
+//Border (pixels) around the fiducial kernel's cross, and how sharply the
+//kernel falls off away from the cross outline
+#define KERNEL_EDGE 1
+#define KERNEL_SHARPNESS 20
+//Number of generated kernels kept, so switching back and forth between
+//fiducial sizes doesn't regenerate them
+#define KERNEL_CACHE_SIZE 4
+
+//Sun center predictor: chord window margin in standard deviations of the
+//prediction error, and never less than this many pixels
+#define PREDICTOR_SIGMAS 3
+#define PREDICTOR_MIN_MARGIN 8
+//Weight of each new prediction error in the running mean square error
+#define PREDICTOR_ERROR_WEIGHT 0.1
+//Longest gap between frames (s) the predictor coasts across
+#define PREDICTOR_MAX_GAP 5.0
+//Chords are placed over this fraction of the predicted diameter, away from
+//the tangent points where the limb crossings are poorly defined
+#define CHORD_SPAN 0.8
+
+//Deepest pyramid level used to acquire the sun (a 16x reduction)
+#define MAX_ACQUISITION_LEVELS 4
+//Fraction of the disk area that must be seen on the coarse level to count
+//as the sun
+#define ACQUISITION_MIN_AREA 0.05
+
+//Shortest band of correlation rows handed to a worker
+#define MIN_BAND_ROWS 16
+//Smallest spread between frame min and max worth processing
+#define MIN_DYNAMIC_RANGE 32
+//Fraction of the gate's samples at full scale that marks a frame as
+//saturated, far more than a saturated disk covers
+#define GATE_SATURATED_FRACTION 0.25
+
+//Rows of correlation per tile for the statistics and peak search. Fixed,
+//so the sums come out the same however many threads there are.
+#define FIDUCIAL_TILE_ROWS 64
+
+//Bin width (pixels) of the fiducial pair distance lookup table
+#define ID_TABLE_STEP 0.25
+//Fiducial ID votes are counted in fixed bins: IDs -9..9, then -201..-199
+//for the votes cast by a partner whose ID was ambiguous (-200)
+#define ID_VOTE_BINS 22
+#define ID_VOTE_NONE -1000
+
+//First line of a checkpoint file. The version changes whenever the layout
+//does, so an old checkpoint is ignored rather than misread.
+#define CHECKPOINT_HEADER "aspect-checkpoint"
+#define CHECKPOINT_VERSION 2
+
 cv::Point2f fiducialIDtoScreen(cv::Point2i id) 
 {
     cv::Point2f result;
@@ -27,7 +95,7 @@ cv::Point2f fiducialIDtoScreen(cv::Point2i id)
     return result;
 }
 
-Aspect::Aspect()
+Aspect::Aspect(const char *checkpoint)
 {
     // Initialize min and max values for the image
     frameMin = 255;
@@ -47,16 +115,112 @@ Aspect::Aspect()
     solarImageSize = solarImage.size();
     solarImageOffset = cv::Point2i(0,0);
 
+    // minMaxTolerance is the allowed error in the rank of the min/max
+    // percentiles, as a fraction of the pixels. 0 histograms every pixel.
+    // With a tolerance, minMaxROIRefresh > 0 reuses the histogram of the
+    // solar subimage for that many frames and only samples the background
+    minMaxTolerance = 0;
+    minMaxROIRefresh = 0;
+    roiHistogramAge = -1;
+
     solarRadius = 98;
     radiusMargin = .25;
     errorLimit = 50;
 
+    // The predictor is an alpha-beta filter on the sun center. While it is
+    // tracking, the chords only cover the disk where it is predicted to be,
+    // plus a margin set by how well the predictions have been doing.
+    // An alpha of 0 turns it off.
+    predictorAlpha = 0;
+    predictorBeta = 0;
+
+    // numThreads > 1 splits the chords and the fiducial correlation across
+    // that many threads (counting the caller). 1 does everything on the
+    // calling thread.
+    numThreads = poolSize = 1;
+    pool = NULL;
+
+    // timeBudget (ms) > 0 lets Run skip the later stages when they would
+    // not finish in time, judging by how long they took last time. Run then
+    // returns what it has so far with one of the *_TIMEOUT codes.
+    timeBudget = 0;
+    for (int k = 0; k < NUM_STAGES; k++)
+        stageTimes[k] = stageEstimates[k] = 0;
+    refineTime = 0;
+
+    // gateStride > 0 first looks at every gateStride-th pixel of every
+    // gateStride-th row, and rejects frames that are saturated, have too
+    // little contrast or have no sun in them without a full Run
+    gateStride = 0;
+    ResetGateCounts();
+    predictorValid = false;
+    usePrediction = false;
+    frameTimed = false;
+
     limbFitWidth = 2;
+
+    // acquisitionLevels > 0 finds a lost sun on a coarse copy of the frame,
+    // halved this many times, and then only runs chords over the window
+    // around the disk found there. 0 runs chords over the whole frame.
+    acquisitionLevels = 0;
+
+    // centerMethod is how the center is found from the limb crossings:
+    // averaging chord midpoints, or a least squares circle fit. Or it can be
+    // the centroid (image moments) of the disk, when the whole disk is on
+    // the sensor. While tracking, that is taken straight from the tracking
+    // window with no chords at all; chords are only run to find the disk.
+    centerMethod = CENTER_CHORDS;
+
+    // momentTolerance > 0 cross-checks the chord center against the disk's
+    // centroid, and rejects it if they differ by more than this (pixels)
+    momentTolerance = 0;
     
     fiducialLength = 15;
     fiducialWidth = 2; 
     fiducialThreshold = 5;
 
+    // fiducialRefine is how fiducial peaks are refined to sub-pixel: the
+    // centroid of the correlation above threshold, or parabolas fitted to
+    // the 3x3 neighborhood of the peak (optionally in log space, for a
+    // Gaussian peak)
+    fiducialRefine = REFINE_CENTROID;
+
+    // correlationMode picks how the fiducial kernel is correlated with the
+    // solar image: dense (matchTemplate), as a sum of separable 1-D passes
+    // over the rank-1 factors of the kernel, or in fixed point straight off
+    // the 8-bit image. kernelRank caps the number of factors; 0 keeps every
+    // factor that matters, which reproduces the kernel
+    correlationMode = CORRELATION_DENSE;
+    kernelRank = 0;
+
+    // fiducialTrackWindow > 0 turns on fiducial tracking: after a frame
+    // solves, the next frame only correlates windows this many pixels
+    // either side of where each fiducial was last seen
+    fiducialTrackWindow = 0;
+    lastSolved = false;
+
+    // idPersistence > 0 carries fiducial IDs forward from the last clean
+    // frame to the nearest fiducial, and only votes on the ones that can't
+    // be matched. Every idPersistence frames all IDs are voted on again as
+    // a consistency check.
+    idPersistence = 0;
+    idVoteAge = 0;
+    carryIDs = false;
+
+    // checkpointInterval > 0 saves the tracking state and parameters to the
+    // checkpoint file after every checkpointInterval-th clean Run
+    checkpointPath = (checkpoint != NULL) ? checkpoint : "";
+    checkpointInterval = 0;
+    checkpointAge = 0;
+    warmStart = false;
+
+    // diskMask != 0 only correlates and searches for fiducials where the
+    // kernel is centered on the solar disk, skipping the dark corners of
+    // the solar image
+    diskMask = 0;
+    bandMasked = false;
+    correlationMean = correlationStddev = 0;
+
     minLimbWidth = fiducialLength;
 
     numFiducials = 12;
@@ -76,33 +240,45 @@ Aspect::Aspect()
     
     GenerateKernel();
     //matchKernel(kernel);
-    mDistances.clear();
-    nDistances.clear();
-    for (int k = 0; k < 14; k++)
-    {
-        if(k < 7)
-        {
-            mDistances.push_back((84-k*6)*fiducialSpacing/15);
-            nDistances.push_back((84-k*6)*fiducialSpacing/15);
-        }
-        else
-        {
-            mDistances.push_back((45 + (k-7)*6)*fiducialSpacing/15);
-            nDistances.push_back((45 + (k-7)*6)*fiducialSpacing/15);
-        }
-    }
+    BuildIDTable();
     mapping.resize(4);
     state = STALE_DATA;
+    result.runResult = STALE_DATA;
+    result.valid = 0;
+    result.limbCount = 0;
+    result.fiducialCount = 0;
+
+    //This build's defaults, which a checkpoint is saved against
+    for (int k = 0; k < NUM_ASPECT_INTS; k++)
+        defaultInts[k] = GetInteger((AspectInt) k);
+    for (int k = 0; k < NUM_ASPECT_FLOATS; k++)
+        defaultFloats[k] = GetFloat((AspectFloat) k);
+
+    //A checkpoint that is missing or can't be read just means a cold start
+    checkpointWriter = NULL;
+    if (!checkpointPath.empty())
+        LoadCheckpoint();
 }
 
 Aspect::~Aspect()
 {
+    //Finishes writing any checkpoint still pending
+    delete checkpointWriter;
+    delete pool;
+}
 
+AspectCode Aspect::LoadFrame(cv::Mat inputFrame, timespec captureTime)
+{
+    AspectCode result = LoadFrame(inputFrame);
+    frameTime = captureTime;
+    frameTimed = true;
+    return result;
 }
 
 AspectCode Aspect::LoadFrame(cv::Mat inputFrame)
 {
     timespec duration;
+    frameTimed = false;
     //std::cout << "Aspect: Loading Frame" << std::endl;
     if(inputFrame.empty())
     {
@@ -119,21 +295,456 @@ AspectCode Aspect::LoadFrame(cv::Mat inputFrame)
             state = FRAME_EMPTY;
             return state;
         }
+        else if (inputFrame.channels() != 1 ||
+                 (inputFrame.depth() != CV_8U && inputFrame.depth() != CV_16U))
+        {
+            //Only 8-bit and 16-bit mono frames can be processed
+            state = FRAME_EMPTY;
+            return state;
+        }
         else
         {
             frame = inputFrame;
             frameSize = frame.size();
 
+            //The tracking window from a checkpoint is only worth trying on
+            //a frame the same size as the one it was saved from. It is cut
+            //out of the frame below like any other tracking window, and the
+            //usual checks in Run decide whether the sun is really there.
+            if (warmStart)
+            {
+                warmStart = false;
+                if (frameSize == checkpointFrameSize)
+                    solarImage = frame;
+                else
+                    ResetTracking();
+            }
+
+            //The solar subimage from the last Run is the tracking window for
+            //this frame. Point it at the same region of the new frame so we
+            //never search a stale buffer, and drop it if it no longer fits.
+            if (!solarImage.empty())
+            {
+                if (solarImageOffset.x >= 0 && solarImageOffset.y >= 0 &&
+                    solarImageOffset.x + solarImageSize.width <= frameSize.width &&
+                    solarImageOffset.y + solarImageSize.height <= frameSize.height)
+                    solarImage = frame(cv::Range(solarImageOffset.y, solarImageOffset.y + solarImageSize.height),
+                                       cv::Range(solarImageOffset.x, solarImageOffset.x + solarImageSize.width));
+                else
+                    solarImage.release();
+            }
+
             state = NO_ERROR;
             return state;
         }
     }
 }
 
+void Aspect::ResetTracking()
+{
+    pixelCenter = cv::Point2f(-1.0, -1.0);
+    pixelError = cv::Point2f(0.0, 0.0);
+    solarImage.release();
+    solarImageOffset = cv::Point2i(0,0);
+    solarImageSize = solarImage.size();
+    roiHistogramAge = -1;
+    lastSolved = false;
+    predictorValid = false;
+    warmStart = false;
+}
+
+//Parameters that belong to the program running Aspect rather than to the
+//tracking, and so are never taken from a checkpoint
+static bool CheckpointedInt(int index)
+{
+    return index != NUM_THREADS && index != CHECKPOINT_INTERVAL;
+}
+
+//A checkpoint is a short text file holding the last clean Run:
+//    aspect-checkpoint <version>
+//    frame <width> <height>
+//    center <x> <y> <error x> <error y>
+//    window <x> <y> <width> <height>          (the solar subimage)
+//    correlation <mean> <stddev>
+//    mapping <4 coefficients>
+//    fiducials <count>
+//    <x> <y> <id x> <id y>                     (one line per fiducial)
+//    int <AspectInt> <value> <default>         (one line per parameter
+//    float <AspectFloat> <value> <default>      set away from its default)
+//    end
+//The kernel and ID tables aren't saved, since they are rebuilt from the
+//parameters. Only parameters that have been set away from this build's
+//default are saved, along with that default. Setting a parameter back to
+//its default drops it from the next checkpoint. The file is written by a
+//CheckpointWriter thread, so Run only pays for formatting it.
+void Aspect::SaveCheckpoint()
+{
+    std::ostringstream file;
+    file.precision(9);
+
+    file << CHECKPOINT_HEADER << " " << CHECKPOINT_VERSION << "\n";
+    file << "frame " << frameSize.width << " " << frameSize.height << "\n";
+    file << "center " << pixelCenter.x << " " << pixelCenter.y << " "
+         << pixelError.x << " " << pixelError.y << "\n";
+    file << "window " << solarImageOffset.x << " " << solarImageOffset.y << " "
+         << solarImageSize.width << " " << solarImageSize.height << "\n";
+    file << "correlation " << correlationMean << " " << correlationStddev << "\n";
+    file << "mapping";
+    for (unsigned int k = 0; k < 4; k++)
+        file << " " << ((k < mapping.size()) ? mapping[k] : 0);
+    file << "\n";
+
+    file << "fiducials " << lastFiducials.size() << "\n";
+    for (unsigned int k = 0; k < lastFiducials.size(); k++)
+    {
+        cv::Point id = (k < lastIDs.size()) ? lastIDs[k] : cv::Point(-100, -100);
+        file << lastFiducials[k].x << " " << lastFiducials[k].y << " "
+             << id.x << " " << id.y << "\n";
+    }
+
+    for (int k = 0; k < NUM_ASPECT_INTS; k++)
+    {
+        int value = GetInteger((AspectInt) k);
+        if (CheckpointedInt(k) && value != defaultInts[k])
+            file << "int " << k << " " << value << " " << defaultInts[k] << "\n";
+    }
+    for (int k = 0; k < NUM_ASPECT_FLOATS; k++)
+    {
+        float value = GetFloat((AspectFloat) k);
+        if (value != defaultFloats[k])
+            file << "float " << k << " " << value << " " << defaultFloats[k] << "\n";
+    }
+    file << "end\n";
+
+    if (checkpointWriter == NULL)
+        checkpointWriter = new CheckpointWriter(checkpointPath);
+    checkpointWriter->Post(file.str());
+}
+
+//Restores the parameters and tracking state from the checkpoint file.
+//Nothing changes unless the whole file reads back cleanly. A parameter is
+//only restored if the default it was saved against is still this build's
+//default, so a changed default isn't overridden by an old checkpoint. The
+//restored center and solar subimage only seed the first frame: it is
+//tracked rather than searched, and if the sun isn't where the checkpoint
+//says, that Run fails its usual checks and the next one searches.
+bool Aspect::LoadCheckpoint()
+{
+    std::ifstream file(checkpointPath.c_str());
+    std::string key;
+    int version, count, index, intValue, intDefault;
+    float floatValue, floatDefault;
+    cv::Size savedFrame, savedWindow;
+    cv::Point2i savedOffset;
+    cv::Point2f center, error;
+    float mean, stddev;
+    std::vector<float> savedMapping(4);
+    CoordList fiducials;
+    IndexList ids;
+    std::vector<std::pair<int, int> > ints;
+    std::vector<std::pair<int, float> > floats;
+
+    if (!(file >> key >> version) || key != CHECKPOINT_HEADER || version != CHECKPOINT_VERSION)
+        return false;
+    if (!(file >> key >> savedFrame.width >> savedFrame.height) || key != "frame")
+        return false;
+    if (!(file >> key >> center.x >> center.y >> error.x >> error.y) || key != "center")
+        return false;
+    if (!(file >> key >> savedOffset.x >> savedOffset.y >> savedWindow.width >> savedWindow.height) ||
+        key != "window")
+        return false;
+    if (!(file >> key >> mean >> stddev) || key != "correlation")
+        return false;
+    if (!(file >> key) || key != "mapping")
+        return false;
+    for (unsigned int k = 0; k < savedMapping.size(); k++)
+        if (!(file >> savedMapping[k]))
+            return false;
+
+    if (!(file >> key >> count) || key != "fiducials" ||
+        count < 0 || count > RESULT_MAX_FIDUCIALS)
+        return false;
+    fiducials.resize(count);
+    ids.resize(count);
+    for (int k = 0; k < count; k++)
+        if (!(file >> fiducials[k].x >> fiducials[k].y >> ids[k].x >> ids[k].y))
+            return false;
+
+    //Parameters, up to the end marker. Indices this build doesn't know,
+    //and parameters whose default has changed since, are skipped.
+    while (file >> key && key != "end")
+    {
+        if (key == "int" && (file >> index >> intValue >> intDefault))
+        {
+            if (index >= 0 && index < NUM_ASPECT_INTS && CheckpointedInt(index) &&
+                intDefault == defaultInts[index])
+                ints.push_back(std::make_pair(index, intValue));
+        }
+        else if (key == "float" && (file >> index >> floatValue >> floatDefault))
+        {
+            if (index >= 0 && index < NUM_ASPECT_FLOATS &&
+                floatDefault == defaultFloats[index])
+                floats.push_back(std::make_pair(index, floatValue));
+        }
+        else
+            return false;
+    }
+    if (key != "end")
+        return false;
+
+    //The window has to be a sensible piece of the frame it came from
+    if (savedFrame.width <= 0 || savedFrame.height <= 0 ||
+        savedWindow.width <= 0 || savedWindow.height <= 0 ||
+        savedOffset.x < 0 || savedOffset.x + savedWindow.width > savedFrame.width ||
+        savedOffset.y < 0 || savedOffset.y + savedWindow.height > savedFrame.height ||
+        center.x < 0 || center.x >= savedFrame.width ||
+        center.y < 0 || center.y >= savedFrame.height)
+        return false;
+
+    //Through the setters, so the kernel and ID tables are rebuilt as needed
+    for (unsigned int k = 0; k < ints.size(); k++)
+        SetInteger((AspectInt) ints[k].first, ints[k].second);
+    for (unsigned int k = 0; k < floats.size(); k++)
+        SetFloat((AspectFloat) floats[k].first, floats[k].second);
+
+    pixelCenter = center;
+    pixelError = error;
+    solarImageOffset = savedOffset;
+    solarImageSize = savedWindow;
+    checkpointFrameSize = savedFrame;
+    correlationMean = mean;
+    correlationStddev = stddev;
+    mapping = savedMapping;
+
+    lastFiducials = fiducials;
+    lastIDs = ids;
+    lastSolved = (count > 0);
+    warmStart = true;
+    return true;
+}
+
+void Aspect::PredictCenter()
+{
+    double dt = 1;
+    usePrediction = false;
+
+    //Lost the sun, so start over once it is found again
+    if (pixelCenter.x < 0 || pixelCenter.y < 0)
+        predictorValid = false;
+    if (predictorAlpha <= 0 || !predictorValid || frameTimed != predictorTimed)
+        return;
+
+    //Without timestamps, time is counted in frames
+    if (frameTimed)
+    {
+        timespec diff = TimespecDiff(predictorTime, frameTime);
+        dt = diff.tv_sec + diff.tv_nsec/1e9;
+        if (dt <= 0 || dt > PREDICTOR_MAX_GAP)
+        {
+            predictorValid = false;
+            return;
+        }
+    }
+
+    predictedCenter = predictorCenter + centerVelocity*dt;
+    predictedSigma = std::sqrt(predictorVariance);
+    predictionStep = dt;
+
+    //Chords need the predicted center to be on the sensor
+    usePrediction = (predictedCenter.x >= 0 && predictedCenter.x < frameSize.width &&
+                     predictedCenter.y >= 0 && predictedCenter.y < frameSize.height);
+}
+
+void Aspect::UpdatePredictor()
+{
+    if (predictorAlpha <= 0) return;
+
+    if (!usePrediction)
+    {
+        //First fix, so no velocity yet. Assume the error is as large as the
+        //fixed margin would allow.
+        predictorCenter = pixelCenter;
+        centerVelocity = cv::Point2f(0,0);
+        predictorVariance = pow(solarRadius*radiusMargin/PREDICTOR_SIGMAS, 2);
+    }
+    else
+    {
+        cv::Point2f residual = pixelCenter - predictedCenter;
+        predictorCenter = predictedCenter + residual*predictorAlpha;
+        centerVelocity = centerVelocity + residual*(predictorBeta/predictionStep);
+        predictorVariance = (1-PREDICTOR_ERROR_WEIGHT)*predictorVariance +
+            PREDICTOR_ERROR_WEIGHT*(residual.x*residual.x + residual.y*residual.y)/2;
+    }
+    predictorTime = frameTime;
+    predictorTimed = frameTimed;
+    predictorValid = true;
+}
+
+void Aspect::FindMinMax(int& min, int& max)
+{
+    unsigned int background[256];
+    double hist[256];
+    unsigned char histMin, histMax;
+    cv::Mat roi;
+
+    //Exact histogram, or a subsampled one when not tracking a subimage.
+    //The cached subimage histogram is only kept for 8-bit frames.
+    if (minMaxTolerance <= 0 || minMaxROIRefresh <= 0 || solarImage.empty() ||
+        solarImageSize == frameSize || frame.depth() != CV_8U)
+    {
+        roiHistogramAge = -1;
+        calcMinMax(frame, min, max, minMaxTolerance);
+        return;
+    }
+
+    //The subimage follows the sun, so its histogram barely changes from
+    //frame to frame. Rebuild it every minMaxROIRefresh frames, or sooner if
+    //the subimage was resized.
+    if (roiHistogramAge < 0 || roiHistogramAge >= minMaxROIRefresh ||
+        roiHistogramSize != solarImageSize)
+    {
+        memset(roiHistogram, 0, sizeof(roiHistogram));
+        AccumulateHistogram(solarImage.ptr<unsigned char>(0), solarImage.rows, solarImage.cols,
+                            solarImage.step, 1, 1, roiHistogram);
+        roiHistogramSize = solarImageSize;
+        roiHistogramAge = 0;
+    }
+    roiHistogramAge++;
+
+    //Sample the background around the subimage: full-width bands above and
+    //below it, and the strips to either side
+    long pixels = (long) frameSize.width*frameSize.height;
+    long roiPixels = (long) solarImageSize.width*solarImageSize.height;
+    int sampleStep = MinMaxSampleStep(pixels - roiPixels, minMaxTolerance);
+    int top = solarImageOffset.y, bottom = solarImageOffset.y + solarImageSize.height;
+    int left = solarImageOffset.x, right = solarImageOffset.x + solarImageSize.width;
+    cv::Rect bands[4] = {cv::Rect(0, 0, frameSize.width, top),
+                         cv::Rect(0, bottom, frameSize.width, frameSize.height - bottom),
+                         cv::Rect(0, top, left, bottom - top),
+                         cv::Rect(right, top, frameSize.width - right, bottom - top)};
+    long samples = 0;
+    memset(background, 0, sizeof(background));
+    for (int k = 0; k < 4; k++)
+    {
+        if (bands[k].width <= 0 || bands[k].height <= 0) continue;
+        roi = frame(bands[k]);
+        AccumulateHistogram(roi.ptr<unsigned char>(0), roi.rows, roi.cols, roi.step,
+                            sampleStep, sampleStep, background);
+        samples += (long) ((roi.rows + sampleStep - 1)/sampleStep)*((roi.cols + sampleStep - 1)/sampleStep);
+    }
+
+    //Each background sample stands in for the pixels around it
+    double weight = (samples > 0) ? (double) (pixels - roiPixels)/samples : 0;
+    for (int j = 0; j < 256; j++)
+        hist[j] = roiHistogram[j] + weight*background[j];
+    histMinMax(hist, pixels, histMin, histMax);
+    min = histMin;
+    max = histMax;
+}
+
+//Every stride-th pixel of every stride-th row of an image, and the largest
+template <typename Pixel>
+static void SampleFrame(const cv::Mat &image, int stride, std::vector<int> &samples,
+                        int &maxValue)
+{
+    samples.clear();
+    maxValue = 0;
+    for (int m = stride/2; m < image.rows; m += stride)
+    {
+        const Pixel *pixels = image.ptr<Pixel>(m);
+        for (int n = stride/2; n < image.cols; n += stride)
+        {
+            samples.push_back(pixels[n]);
+            if (pixels[n] > maxValue) maxValue = pixels[n];
+        }
+    }
+}
+
+//Classifies the frame from a sparse sample before any full pass over it.
+//Returns NO_ERROR if the frame is worth a full Run. Otherwise sets state,
+//with frameMin and frameMax estimated from the sample.
+AspectCode Aspect::GateFrame()
+{
+    int sampleMax, fullScale, threshold;
+    long saturated = 0, bright = 0;
+
+    if (frame.depth() == CV_16U)
+        SampleFrame<unsigned short>(frame, gateStride, gateSamples, sampleMax);
+    else
+        SampleFrame<unsigned char>(frame, gateStride, gateSamples, sampleMax);
+    long n = gateSamples.size();
+    if (n == 0)
+    {
+        gateCounts[GATE_PASSED]++;
+        return NO_ERROR;
+    }
+
+    //The same percentiles as histMinMax
+    long lowRank = std::max((long) std::ceil(0.005*n) - 1, 0L);
+    long highRank = std::max((long) std::floor(0.995*n) - 1, 0L);
+    std::nth_element(gateSamples.begin(), gateSamples.begin() + lowRank, gateSamples.end());
+    frameMin = gateSamples[lowRank];
+    std::nth_element(gateSamples.begin(), gateSamples.begin() + highRank, gateSamples.end());
+    frameMax = gateSamples[highRank];
+
+    //Full scale of an 8, 10, 12 or 16-bit camera mode
+    if (frame.depth() != CV_16U) fullScale = 255;
+    else if (sampleMax <= 1023) fullScale = 1023;
+    else if (sampleMax <= 4095) fullScale = 4095;
+    else fullScale = 65535;
+
+    threshold = frameMin + diskThreshold*(frameMax-frameMin);
+    for (long k = 0; k < n; k++)
+    {
+        if (gateSamples[k] >= fullScale) saturated++;
+        if (gateSamples[k] > threshold) bright++;
+    }
+
+    if (saturated > GATE_SATURATED_FRACTION*n)
+    {
+        gateCounts[GATE_SATURATED]++;
+        state = FRAME_SATURATED;
+        return state;
+    }
+    if (frameMax - frameMin < MIN_DYNAMIC_RANGE)
+    {
+        gateCounts[GATE_LOW_CONTRAST]++;
+        state = DYNAMIC_RANGE_LOW;
+        return state;
+    }
+    //Each sample stands in for stride x stride pixels
+    if ((double) bright*gateStride*gateStride < ACQUISITION_MIN_AREA*pi*solarRadius*solarRadius)
+    {
+        gateCounts[GATE_NO_SUN]++;
+        pixelCenter = cv::Point2f(-1,-1);
+        state = NO_LIMB_CROSSINGS;
+        return state;
+    }
+
+    gateCounts[GATE_PASSED]++;
+    return NO_ERROR;
+}
+
 AspectCode Aspect::Run()
+{
+    StartStages();
+    ProcessFrame();
+    FillResult();
+    return state;
+}
+
+AspectCode Aspect::FiducialRun()
+{
+    StartStages();
+    ProcessFiducials();
+    FillResult();
+    return state;
+}
+
+AspectCode Aspect::ProcessFrame()
 {
     cv::Range rowRange, colRange;
-    unsigned char max, min;
+    int max, min;
     limbCrossings.clear();    
     slopes.clear();    
     pixelFiducials.clear();
@@ -144,6 +755,17 @@ AspectCode Aspect::Run()
     conditionNumbers.clear();
     conditionNumbers.resize(2);
 
+    //Fiducials can only be tracked from a frame that solved cleanly
+    trackFiducials = lastSolved && fiducialTrackWindow > 0;
+    carryIDs = lastSolved && idPersistence > 0;
+    lastSolved = false;
+
+    //Pick up any change in fiducial size, kernel rank or threads since the
+    //last frame
+    if (kernelStale)
+        GenerateKernel();
+    UpdatePool();
+
     //cv::namedWindow("ROI", CV_WINDOW_NORMAL | CV_WINDOW_KEEPRATIO | CV_GUI_EXPANDED );
 
     if (state == FRAME_EMPTY)
@@ -154,31 +776,64 @@ AspectCode Aspect::Run()
     }
     else
     {
+        if (gateStride > 0 && GateFrame() != NO_ERROR)
+        {
+            EndStage(STAGE_MINMAX);
+            return state;
+        }
+
         //std::cout << "Aspect: Finding max and min pixel values" << std::endl;
-        calcMinMax(frame, min, max);
-        frameMin = (unsigned char) min;
-        frameMax = (unsigned char) max;
+        FindMinMax(min, max);
+        frameMin = min;
+        frameMax = max;
+        EndStage(STAGE_MINMAX);
         if (min >= max || std::isnan(min) || std::isnan(max))
         {
             //std::cout << "Aspect: Max/Min value bad" << std::endl;
             state = MIN_MAX_BAD;
             return state;
         }
-        else if(max - min < 32)
+        else if(max - min < MIN_DYNAMIC_RANGE)
         {
             state = DYNAMIC_RANGE_LOW;
             return state;
         }
         //std::cout << "Aspect: Finding Center" << std::endl;
-        FindPixelCenter();
-        if (limbCrossings.size() == 0)
+        if (!StageFits(STAGE_CENTER))
+        {
+            state = LIMB_TIMEOUT;
+            return state;
+        }
+        PredictCenter();
+
+        //With CENTER_MOMENTS, a disk that sits whole in the tracking window
+        //gives its center straight from the moments, without any chords
+        bool momentCenter = false;
+        if (centerMethod == CENTER_MOMENTS && !solarImage.empty() &&
+            pixelCenter.x >= 0 && pixelCenter.x < frameSize.width &&
+            pixelCenter.y >= 0 && pixelCenter.y < frameSize.height)
+        {
+            cv::Point2f centroid;
+            bool clipped;
+            if (FindMomentCenter(usePrediction ? predictedCenter : pixelCenter, centroid, clipped) &&
+                !clipped)
+            {
+                pixelCenter = centroid;
+                pixelError = cv::Point2f(0,0);
+                momentCenter = true;
+            }
+        }
+        if (!momentCenter)
+            FindPixelCenter();
+        EndStage(STAGE_CENTER);
+        if (!momentCenter && limbCrossings.size() == 0)
         {
             //std::cout << "Aspect: No Limb Crossings." << std::endl;
             state = NO_LIMB_CROSSINGS;
             pixelCenter = cv::Point2f(-1,-1);
             return state;
         }
-        else if (limbCrossings.size() < 4)
+        else if (!momentCenter && limbCrossings.size() < 4)
         {
             //std::cout << "Aspect: Too Few Limb Crossings." << std::endl;
             state = FEW_LIMB_CROSSINGS;
@@ -204,6 +859,28 @@ AspectCode Aspect::Run()
             return state;
         }
 
+        //Centroid of the disk, to check or replace the chord center
+        if (!momentCenter && (centerMethod == CENTER_MOMENTS || momentTolerance > 0))
+        {
+            cv::Point2f centroid;
+            bool clipped;
+            if (FindMomentCenter(pixelCenter, centroid, clipped) && !clipped)
+            {
+                if (momentTolerance > 0 &&
+                    (std::abs(centroid.x - pixelCenter.x) > momentTolerance ||
+                     std::abs(centroid.y - pixelCenter.y) > momentTolerance))
+                {
+                    pixelCenter = cv::Point2f(-1,-1);
+                    state = CENTER_ERROR_LARGE;
+                    return state;
+                }
+                if (centerMethod == CENTER_MOMENTS)
+                    pixelCenter = centroid;
+            }
+        }
+
+        UpdatePredictor();
+
         //Find solar subImage
         //std::cout << "Aspect: Finding solar subimage" << std::endl;
         int subimageSize = solarRadius*(1+radiusMargin);
@@ -248,7 +925,13 @@ AspectCode Aspect::Run()
           
         //Find fiducials
         //std::cout << "Aspect: Finding Fiducials" << std::endl;
-        FindPixelFiducials();
+        if (!StageFits(STAGE_FIDUCIALS))
+        {
+            state = FIDUCIAL_TIMEOUT;
+            return state;
+        }
+        FindPixelFiducials(diskMask != 0);
+        EndStage(STAGE_FIDUCIALS);
         if (pixelFiducials.size() == 0)
         {
             //std::cout << "Aspect: No Fiducials found" << std::endl;
@@ -264,7 +947,13 @@ AspectCode Aspect::Run()
 
         //Find fiducial IDs
         //std::cout << "Aspect: Finding fiducial IDs" << std::endl;
+        if (!StageFits(STAGE_IDS))
+        {
+            state = ID_TIMEOUT;
+            return state;
+        }
         FindFiducialIDs();
+        EndStage(STAGE_IDS);
         //count number of valid IDs
         for (int k = 0; k < fiducialIDs.size(); k++)
         {
@@ -286,7 +975,13 @@ AspectCode Aspect::Run()
         }
 
         //std::cout << "Aspect: Finding Mapping" << std::endl;
+        if (!StageFits(STAGE_MAPPING))
+        {
+            state = MAPPING_TIMEOUT;
+            return state;
+        }
         FindMapping();
+        EndStage(STAGE_MAPPING);
         if (/*ILL CONDITIONED*/ false)
         {
             //std::cout << "Aspect: Mapping is ill-conditioned." << std::endl;
@@ -295,15 +990,23 @@ AspectCode Aspect::Run()
         }
 
     }
+    lastFiducials = pixelFiducials;
+    lastIDs = fiducialIDs;
+    lastSolved = true;
+    if (checkpointInterval > 0 && !checkpointPath.empty() &&
+        ++checkpointAge >= checkpointInterval)
+    {
+        SaveCheckpoint();
+        checkpointAge = 0;
+    }
     state = NO_ERROR;
     return state;
 }
 
-AspectCode Aspect::FiducialRun()
+AspectCode Aspect::ProcessFiducials()
 {
-
     cv::Range rowRange, colRange;
-    unsigned char max, min;
+    int max, min;
     limbCrossings.clear();
     slopes.clear();
     pixelFiducials.clear();
@@ -313,6 +1016,15 @@ AspectCode Aspect::FiducialRun()
     mapping.resize(4);
     conditionNumbers.clear();
     conditionNumbers.resize(2);
+    trackFiducials = false;
+    lastSolved = false;
+    usePrediction = false;
+
+    //Pick up any change in fiducial size, kernel rank or threads since the
+    //last frame
+    if (kernelStale)
+        GenerateKernel();
+    UpdatePool();
 
     //cv::namedWindow("ROI", CV_WINDOW_NORMAL | CV_WINDOW_KEEPRATIO | CV_GUI_EXPANDED );
 
@@ -325,16 +1037,16 @@ AspectCode Aspect::FiducialRun()
     else
     {
         //std::cout << "Aspect: Finding max and min pixel values" << std::endl;
-        calcMinMax(frame, min, max);
-        frameMin = (unsigned char) min;
-        frameMax = (unsigned char) max;
+        FindMinMax(min, max);
+        frameMin = min;
+        frameMax = max;
         if (min >= max || std::isnan(min) || std::isnan(max))
         {
             //std::cout << "Aspect: Max/Min value bad" << std::endl;
             state = MIN_MAX_BAD;
             return state;
         }
-        else if(max - min < 32)
+        else if(max - min < MIN_DYNAMIC_RANGE)
         {
             state = DYNAMIC_RANGE_LOW;
             return state;
@@ -373,7 +1085,7 @@ AspectCode Aspect::FiducialRun()
 
         //Find fiducials
         //std::cout << "Aspect: Finding Fiducials" << std::endl;
-        FindPixelFiducials();
+        FindPixelFiducials(false);
         if (pixelFiducials.size() == 0)
         {
             //std::cout << "Aspect: No Fiducials found" << std::endl;
@@ -431,6 +1143,18 @@ Data product Get functions
 ***************************************************/
 
 AspectCode Aspect::GetPixelMinMax(unsigned char& min, unsigned char& max)
+{
+    if (state < FRAME_EMPTY)
+    {
+        //Saturates for frames deeper than 8 bits
+        max = std::min(frameMax, 255);
+        min = std::min(frameMin, 255);
+        return NO_ERROR;
+    }
+    else return state;
+}
+
+AspectCode Aspect::GetPixelMinMax(int& min, int& max)
 {
     if (state < FRAME_EMPTY)
     {
@@ -565,12 +1289,156 @@ AspectCode Aspect::GetScreenFiducials(CoordList& fiducials)
         
 }
 
+void Aspect::UpdatePool()
+{
+    //Only done between frames, since parameters can be set from another
+    //thread while a frame is being processed
+    if (poolSize == numThreads) return;
+
+    delete pool;
+    pool = (numThreads > 1) ? new WorkerPool(numThreads) : NULL;
+    poolSize = numThreads;
+}
+
+void Aspect::RunTasks(WorkerPool::Task task, int count)
+{
+    if (pool != NULL)
+        pool->Run(task, this, count);
+    else
+        for (int k = 0; k < count; k++)
+            task(this, k);
+}
+
+void Aspect::StartStages()
+{
+    clock_gettime(CLOCK_MONOTONIC, &runStart);
+    stageStart = runStart;
+    for (int k = 0; k < NUM_STAGES; k++)
+        stageTimes[k] = 0;
+    refineTime = 0;
+}
+
+void Aspect::EndStage(AspectStage stage)
+{
+    timespec now, diff;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    diff = TimespecDiff(stageStart, now);
+    stageTimes[stage] = diff.tv_sec*1e3 + diff.tv_nsec/1e6;
+    stageEstimates[stage] = stageTimes[stage];
+    stageStart = now;
+}
+
+bool Aspect::StageFits(AspectStage stage)
+{
+    timespec now, diff;
+    float elapsed;
+
+    if (timeBudget <= 0) return true;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    diff = TimespecDiff(runStart, now);
+    elapsed = diff.tv_sec*1e3 + diff.tv_nsec/1e6;
+    if (elapsed + stageEstimates[stage] <= timeBudget)
+        return true;
+
+    //A stage that is skipped is never timed again, so let its estimate
+    //decay. One slow frame then doesn't lock the stage out for good.
+    stageEstimates[stage] *= 0.5;
+    return false;
+}
+
+float Aspect::GetStageTime(AspectStage stage)
+{
+    return (stage >= 0 && stage < NUM_STAGES) ? stageTimes[stage] : 0;
+}
+
+float Aspect::GetRefineTime()
+{
+    return refineTime;
+}
+
+unsigned long Aspect::GetGateCount(GateDecision decision)
+{
+    return (decision >= 0 && decision < NUM_GATE_DECISIONS) ? gateCounts[decision] : 0;
+}
+
+void Aspect::ResetGateCounts()
+{
+    for (int k = 0; k < NUM_GATE_DECISIONS; k++)
+        gateCounts[k] = 0;
+}
+
+const AspectResult& Aspect::GetResult()
+{
+    return result;
+}
+
+void Aspect::FillResult()
+{
+    unsigned int k, K;
+
+    result.runResult = state;
+    result.valid = ValidProducts(state);
+    for (k = 0; k < NUM_STAGES; k++)
+        result.stageTimes[k] = stageTimes[k];
+    result.limbCount = 0;
+    result.fiducialCount = 0;
+
+    if (result.valid & PRODUCT_MINMAX)
+    {
+        result.frameMin = frameMin;
+        result.frameMax = frameMax;
+    }
+
+    if (result.valid & PRODUCT_LIMBS)
+    {
+        K = std::min((unsigned int) limbCrossings.size(), (unsigned int) RESULT_MAX_LIMBS);
+        for (k = 0; k < K; k++)
+            result.limbCrossings[k] = limbCrossings[k];
+        result.limbCount = K;
+    }
+
+    if (result.valid & PRODUCT_CENTER)
+    {
+        result.pixelCenter = pixelCenter;
+        result.pixelError = pixelError;
+    }
+
+    if (result.valid & PRODUCT_FIDUCIALS)
+    {
+        K = std::min((unsigned int) pixelFiducials.size(), (unsigned int) RESULT_MAX_FIDUCIALS);
+        for (k = 0; k < K; k++)
+            result.pixelFiducials[k] = pixelFiducials[k];
+        result.fiducialCount = K;
+
+        if (result.valid & PRODUCT_IDS)
+        {
+            for (k = 0; k < K; k++)
+                result.fiducialIDs[k] = (k < fiducialIDs.size()) ? fiducialIDs[k] : cv::Point(-300, -300);
+        }
+    }
+
+    if (result.valid & PRODUCT_MAPPING)
+    {
+        for (k = 0; k < 4; k++)
+            result.mapping[k] = (k < mapping.size()) ? mapping[k] : 0;
+        result.screenCenter = PixelToScreen(pixelCenter);
+        for (k = 0; k < (unsigned int) result.fiducialCount; k++)
+            result.screenFiducials[k] = PixelToScreen(pixelFiducials[k]);
+    }
+}
+
 /*************************************************************************
 
 Aspect Parameter Set/Get Functions
 
 *************************************************************************/
 
+float Aspect::GetKernelError()
+{
+    return kernelError;
+}
+
 float Aspect::GetFloat(AspectFloat variable)
 {
     switch(variable)
@@ -591,6 +1459,16 @@ float Aspect::GetFloat(AspectFloat variable)
         return fiducialSpacingTol;
     case FIDUCIAL_TWIST:
         return fiducialTwist;
+    case MINMAX_TOLERANCE:
+        return minMaxTolerance;
+    case PREDICTOR_ALPHA:
+        return predictorAlpha;
+    case PREDICTOR_BETA:
+        return predictorBeta;
+    case TIME_BUDGET:
+        return timeBudget;
+    case MOMENT_TOLERANCE:
+        return momentTolerance;
     default:
         return 0;
     }
@@ -616,6 +1494,30 @@ int Aspect::GetInteger(AspectInt variable)
         return fiducialWidth;
     case NUM_FIDUCIALS:
         return numFiducials;
+    case MINMAX_ROI_REFRESH:
+        return minMaxROIRefresh;
+    case CORRELATION_MODE:
+        return correlationMode;
+    case KERNEL_RANK:
+        return kernelRank;
+    case FIDUCIAL_TRACK_WINDOW:
+        return fiducialTrackWindow;
+    case CENTER_METHOD:
+        return centerMethod;
+    case FIDUCIAL_REFINE:
+        return fiducialRefine;
+    case ACQUISITION_LEVELS:
+        return acquisitionLevels;
+    case NUM_THREADS:
+        return numThreads;
+    case DISK_MASK:
+        return diskMask;
+    case ID_PERSISTENCE:
+        return idPersistence;
+    case GATE_STRIDE:
+        return gateStride;
+    case CHECKPOINT_INTERVAL:
+        return checkpointInterval;
     default:
         return 0;
     }
@@ -642,13 +1544,32 @@ void Aspect::SetFloat(AspectFloat variable, float value)
         break;
     case FIDUCIAL_SPACING:
         fiducialSpacing = value;
+        idTableStale = true;
         break;
     case FIDUCIAL_SPACING_TOL:
         fiducialSpacingTol = value;
+        idTableStale = true;
         break;
     case FIDUCIAL_TWIST:
         fiducialTwist = value;
         break;
+    case MINMAX_TOLERANCE:
+        minMaxTolerance = value;
+        break;
+    case PREDICTOR_ALPHA:
+        predictorAlpha = value;
+        predictorValid = false;
+        break;
+    case TIME_BUDGET:
+        timeBudget = value;
+        break;
+    case MOMENT_TOLERANCE:
+        momentTolerance = value;
+        break;
+    case PREDICTOR_BETA:
+        predictorBeta = value;
+        predictorValid = false;
+        break;
     default:
         return;
     }
@@ -676,41 +1597,132 @@ void Aspect::SetInteger(AspectInt variable, int value)
         break;
     case FIDUCIAL_LENGTH:
         fiducialLength = value;
+        kernelStale = true;
         break;
     case FIDUCIAL_WIDTH:
         fiducialWidth = value;
+        kernelStale = true;
         break;
     case NUM_FIDUCIALS:
         numFiducials = value;
         break;
-    default:
-        return;
-    }
-    return;
-}
-        
-/**********************************************************
-
-Aspect Private processing functions
+    case MINMAX_ROI_REFRESH:
+        minMaxROIRefresh = value;
+        roiHistogramAge = -1;
+        break;
+    case CORRELATION_MODE:
+        correlationMode = value;
+        break;
+    case KERNEL_RANK:
+        kernelRank = value;
+        //Refactored between frames, since a Run may be using the factors
+        kernelStale = true;
+        break;
+    case FIDUCIAL_TRACK_WINDOW:
+        fiducialTrackWindow = value;
+        break;
+    case CENTER_METHOD:
+        centerMethod = value;
+        break;
+    case FIDUCIAL_REFINE:
+        fiducialRefine = value;
+        break;
+    case NUM_THREADS:
+        //0 uses every online core
+        if (value <= 0) value = sysconf(_SC_NPROCESSORS_ONLN);
+        numThreads = (value > 1) ? value : 1;
+        break;
+    case ACQUISITION_LEVELS:
+        acquisitionLevels = (value < 0) ? 0 : value;
+        if (acquisitionLevels > MAX_ACQUISITION_LEVELS)
+            acquisitionLevels = MAX_ACQUISITION_LEVELS;
+        break;
+    case DISK_MASK:
+        diskMask = value;
+        break;
+    case ID_PERSISTENCE:
+        idPersistence = (value > 0) ? value : 0;
+        break;
+    case GATE_STRIDE:
+        gateStride = (value > 0) ? value : 0;
+        break;
+    case CHECKPOINT_INTERVAL:
+        checkpointInterval = (value > 0) ? value : 0;
+        checkpointAge = 0;
+        break;
+    default:
+        return;
+    }
+    return;
+}
+        
+/**********************************************************
+
+Aspect Private processing functions
 
 ***********************************************************/
 
 void Aspect::GenerateKernel()
 {
-    int edge = 1, d = 20;
-    cv::Mat distanceField, subField, bar, mask, shape;
+    unsigned int k;
+
+    //Most recently used kernel first
+    for (k = 0; k < kernelCache.size(); k++)
+    {
+        if (kernelCache[k].length == fiducialLength &&
+            kernelCache[k].width == fiducialWidth &&
+            kernelCache[k].edge == KERNEL_EDGE &&
+            kernelCache[k].sharpness == KERNEL_SHARPNESS)
+            break;
+    }
+
+    if (k == kernelCache.size())
+    {
+        KernelCacheEntry entry;
+        entry.length = fiducialLength;
+        entry.width = fiducialWidth;
+        entry.edge = KERNEL_EDGE;
+        entry.sharpness = KERNEL_SHARPNESS;
+        BuildKernel(fiducialLength, fiducialWidth, KERNEL_EDGE, KERNEL_SHARPNESS,
+                    entry.kernel);
+        if (kernelCache.size() >= KERNEL_CACHE_SIZE)
+            kernelCache.pop_back();
+        kernelCache.insert(kernelCache.begin(), entry);
+    }
+    else if (k > 0)
+    {
+        std::rotate(kernelCache.begin(), kernelCache.begin() + k,
+                    kernelCache.begin() + k + 1);
+    }
+
+    //Cached kernels are never modified in place, so they can be shared
+    kernel = kernelCache[0].kernel;
+    FactorKernel();
+
+    kernelQuantized.resize(kernel.rows*kernel.cols);
+    for (int m = 0; m < kernel.rows; m++)
+        for (int n = 0; n < kernel.cols; n++)
+            kernelQuantized[m*kernel.cols + n] = (short) round(kernel.at<float>(m,n)*KERNEL_SCALE);
+
+    kernelStale = false;
+    return;
+}
+
+void Aspect::BuildKernel(int length, int width, int edge, int d, cv::Mat &output)
+{
+    cv::Mat shape, bar, inside, outside, insideDistance, outsideDistance;
     cv::Range crossLength, crossWidth;
-    double minVal;
-    kernel = cv::Mat(2*(fiducialLength/2 + edge) + 1, 
-                     2*(fiducialLength/2 + edge) + 1,
+    float distance;
+
+    output = cv::Mat(2*(length/2 + edge) + 1,
+                     2*(length/2 + edge) + 1,
                      CV_32FC1);
-    shape = cv::Mat::zeros(kernel.size(), CV_32FC1);
- 
+    shape = cv::Mat::zeros(output.size(), CV_32FC1);
+
     crossLength = SafeRange(edge, shape.rows-edge, shape.rows);
-    crossWidth = SafeRange((fiducialLength/2) + 1 - (fiducialWidth/2),
-                           (fiducialLength/2) + 1 + (fiducialWidth/2) + 1,
+    crossWidth = SafeRange((length/2) + 1 - (width/2),
+                           (length/2) + 1 + (width/2) + 1,
                            shape.rows);
-    mask = cv::Mat(shape.rows, shape.cols, CV_8UC1);
 
     bar = shape(crossLength, crossWidth);
     bar += cv::Mat::ones(bar.rows, bar.cols, CV_32FC1);
@@ -718,55 +1730,120 @@ void Aspect::GenerateKernel()
     bar = shape(crossWidth, crossLength);
     bar += cv::Mat::ones(bar.rows, bar.cols, CV_32FC1);
 
-    distanceField = cv::Mat::zeros(2*shape.rows + 1, 2*shape.cols + 1, CV_32FC1);
-    for (int m = 0; m < distanceField.rows; m++)
-    {
-        for (int n = 0; n < distanceField.cols; n++)
-        {
-            distanceField.at<float>(m,n) = Euclidian(cv::Point2f(shape.rows - m,
-                                                                 shape.cols - n));
-        }
-    }
+    //Each pixel is weighted by its Euclidian distance to the nearest pixel
+    //on the other side of the cross outline. distanceTransform measures the
+    //distance to the nearest zero pixel, so the cross is zeroed to measure
+    //outside pixels and vice versa.
+    compare(shape, 0, inside, cv::CMP_GT);
+    compare(shape, 0, outside, cv::CMP_EQ);
+    cv::distanceTransform(inside, insideDistance, CV_DIST_L2, CV_DIST_MASK_PRECISE);
+    cv::distanceTransform(outside, outsideDistance, CV_DIST_L2, CV_DIST_MASK_PRECISE);
 
     for (int m = 0; m < shape.rows; m++)
     {
         for (int n = 0; n < shape.cols; n++)
         {
-            subField = distanceField(cv::Range(shape.rows - m, 2*shape.rows - m),
-                                     cv::Range(shape.cols - n, 2*shape.cols - n));
-            
             if (shape.at<float>(m,n) > 0)
-                compare(shape, 0, mask, cv::CMP_EQ);
+                distance = insideDistance.at<float>(m,n);
             else
-                compare(shape, 0, mask, cv::CMP_GT);
-
-            cv::minMaxIdx(subField, &minVal, NULL, NULL, NULL, mask);
-            kernel.at<float>(m,n) = ((shape.at<float>(m,n) > 0) ? 1 : -1) * (-pow(d,2)/2)*exp(-d*((float) minVal));
+                distance = outsideDistance.at<float>(m,n);
+            output.at<float>(m,n) = ((shape.at<float>(m,n) > 0) ? 1 : -1) * (-pow(d,2)/2)*exp(-d*distance);
         }
     }
 
-    cv::normalize(kernel, kernel, -1, 1,cv::NORM_MINMAX);
-    
+    cv::normalize(output, output, -1, 1,cv::NORM_MINMAX);
 /*
   for (int m = 0; m < shape.rows; m++)
   {
   for (int n = 0; n < shape.cols; n++)
   {
-  std::cout << kernel.at<float>(m,n) << " ";
+  std::cout << output.at<float>(m,n) << " ";
   }
   std::cout << std::endl;
   }
 */
-    return;
 }
 
-int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossings)
+void Aspect::FactorKernel()
 {
-    std::vector<int> edges;
-    std::vector<bool> edgeFlag;
-    std::vector<float> x, y, fit;
-    unsigned char thisValue, lastValue, pixelLowerThreshold, pixelUpperThreshold, pixelMax;
-    int K = chord.total();
+    cv::Mat w, u, vt;
+    double total = 0, kept = 0;
+    float sigma;
+
+    kernelRowFactors.clear();
+    kernelColFactors.clear();
+
+    //kernel = sum of w[r]*u[r]*vt[r], so each term is a vertical pass with
+    //u[r] followed by a horizontal pass with vt[r]
+    cv::SVD::compute(kernel, w, u, vt);
+    for (int r = 0; r < w.rows; r++)
+        total += w.at<float>(r)*w.at<float>(r);
+
+    for (int r = 0; r < w.rows; r++)
+    {
+        if (kernelRank > 0 && r >= kernelRank) break;
+        sigma = w.at<float>(r);
+        if (sigma <= KERNEL_RANK_EPSILON*w.at<float>(0)) break;
+        kernelColFactors.push_back(cv::Mat(u.col(r)*std::sqrt(sigma)));
+        kernelRowFactors.push_back(cv::Mat(vt.row(r)*std::sqrt(sigma)));
+        kept += sigma*sigma;
+    }
+
+    //Relative Frobenius norm of what the dropped factors leave out
+    kernelError = (total > 0 && total > kept) ? std::sqrt((total - kept)/total) : 0;
+}
+
+//Packs the chords of input into chordBuffer and finds the crossings of
+//every chord, spread across the workers. Each chord has its own result, to
+//be combined in chord order however they were computed.
+template <typename Pixel>
+void Aspect::ScanChords(const cv::Mat &input, const std::vector<int> &rows,
+                        const std::vector<int> &cols)
+{
+    //One contiguous buffer, rows first
+    size_t pixels = rows.size()*input.cols + cols.size()*input.rows;
+    chordBuffer.resize(pixels*sizeof(Pixel));
+    Pixel *rowChords = (Pixel *) &chordBuffer[0];
+    GatherChords(input.ptr<Pixel>(0), input.rows, input.cols, input.step,
+                 &rows[0], rows.size(), &cols[0], cols.size(), rowChords);
+
+    chordInput = input;
+    chordRows = rowChords;
+    chordCols = rowChords + rows.size()*input.cols;
+    chordResults.resize(cols.size() + rows.size());
+    chordColCount = cols.size();
+    RunTasks(ChordTask<Pixel>, chordResults.size());
+}
+
+template <typename Pixel>
+void Aspect::ChordTask(void *arg, int index)
+{
+    Aspect *aspect = (Aspect *) arg;
+    ChordResult &chord = aspect->chordResults[index];
+    const cv::Mat &input = aspect->chordInput;
+    const Pixel *rowChords = (const Pixel *) aspect->chordRows;
+    const Pixel *colChords = (const Pixel *) aspect->chordCols;
+
+    chord.crossings.clear();
+    chord.slopes.clear();
+    if (index < aspect->chordColCount)
+        chord.error = aspect->FindLimbCrossings(colChords + index*input.rows, input.rows,
+                                                chord.crossings, chord.slopes);
+    else
+        chord.error = aspect->FindLimbCrossings(rowChords + (index - aspect->chordColCount)*input.cols,
+                                                input.cols, chord.crossings, chord.slopes);
+}
+
+template <typename Pixel>
+int Aspect::FindLimbCrossings(const Pixel *pixels, int K, std::vector<float> &crossings,
+                              std::vector<float> &edgeSlopes)
+{
+    int edges[MAX_LIMB_EDGES];
+    bool edgeFlag[MAX_LIMB_EDGES];
+    int numEdges, numKept;
+    LineAccumulator edgeFit;
+    float intercept, slope;
+    Pixel pixelLowerThreshold, pixelMax;
     int edgeSpread;
     int edge, min, max;
     int N;
@@ -774,43 +1851,29 @@ int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossing
 
     float lowerThreshold = frameMin + limbThreshold*(frameMax-frameMin);
     float upperThreshold = frameMin + diskThreshold*(frameMax-frameMin);
-    pixelLowerThreshold = (unsigned char) lowerThreshold;
-    pixelUpperThreshold = (unsigned char) upperThreshold;
+    pixelLowerThreshold = (Pixel) lowerThreshold;
 
     //for each pixel, check if the pixel lies on a potential limb
-    lastValue = (int) chord.at<unsigned char>(0);
-    pixelMax = lastValue;
-    edges.clear();
-    edgeFlag.clear();
-    for (int k = 1; k < K; k++)
-    {
-        thisValue = (int) chord.at<unsigned char>(k);
-        if (thisValue > pixelMax)
-            pixelMax = thisValue;
-        //check for a rising edge, save the index above the threshold
-        if (lastValue <= pixelLowerThreshold && thisValue > pixelLowerThreshold)
-        {
-            edges.push_back(k);
-        }
-        //check for a falling edge
-        else if(lastValue > pixelLowerThreshold && thisValue <= pixelLowerThreshold)
-        {
-            edges.push_back(-(k-1));
-        }
-        lastValue = thisValue;
-    }
+    numEdges = FindThresholdCrossings(pixels, K, pixelLowerThreshold,
+                                      edges, MAX_LIMB_EDGES, pixelMax);
 
     if (pixelMax < upperThreshold)
     {
         //std::cout << "Chord is too dim to be the sun." << std::endl;
         return -1;
     }
-    else if (edges.size() <= 0)
+    else if (numEdges <= 0)
     {
         //std::cout << "No edges found" << std::endl;
         return -1;
     }
-    else if (edges.size() == 1)
+    else if (numEdges > MAX_LIMB_EDGES)
+    {
+        //A chord this noisy around the threshold isn't a usable limb
+        //std::cout << "Too many edges found" << std::endl;
+        return -1;
+    }
+    else if (numEdges == 1)
     {
         //std::cout << "One edge found" << std::endl;
 
@@ -825,7 +1888,7 @@ int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossing
         {
             edge = abs(edges[0]);
             //std::cout << "Special falling edge for " << edge << std::endl;
-            edges.resize(2);
+            numEdges = 2;
             edges[0] = -1;
             edges[1] = -edge;
         }
@@ -833,7 +1896,7 @@ int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossing
         {
             edge = abs(edges[0]);
             //std::cout << "Special rising edge for " << edge << std::endl;
-            edges.resize(2);
+            numEdges = 2;
             edges[0] = edge;
             edges[1] = -K;
         }
@@ -846,8 +1909,9 @@ int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossing
         //For multiple edges, remove edge pairs that are too closely spaced
         
         //Generate a list of flags for each edge.
-        edgeFlag.resize(edges.size(), false);
-        for (unsigned int k = 1; k < edges.size(); k++)
+        for (int k = 0; k < numEdges; k++)
+            edgeFlag[k] = false;
+        for (int k = 1; k < numEdges; k++)
         {
             //find distance between next edge pair
             //positive if the region is below the threshold
@@ -863,19 +1927,17 @@ int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossing
         }
 
         //Remove any edges which are flagged as invalid.
-        for (int k = 0; k < edgeFlag.size(); k++)
+        numKept = 0;
+        for (int k = 0; k < numEdges; k++)
         {
-            if (edgeFlag[k])
-            {
-                edgeFlag.erase(edgeFlag.begin() + k, edgeFlag.begin() + k + 1);
-                edges.erase(edges.begin() + k, edges.begin() + k + 1);
-                k--;
-            }
+            if (!edgeFlag[k])
+                edges[numKept++] = edges[k];
         }
+        numEdges = numKept;
     }
     
     // at this point we're reasonably certain we've found a valid chord
-    if ((edges.size() == 2) && (edges[0] >= -1)  && (edges[1] < 0))
+    if ((numEdges == 2) && (edges[0] >= -1)  && (edges[1] < 0))
     {
         // for each edge, perform a fit to find the limb crossing
         crossings.clear();
@@ -894,7 +1956,7 @@ int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossing
                 if ((edge-limbFitWidth) < 0) min = 0;
                 else min = edge-limbFitWidth;
                
-                if ((edge+limbFitWidth) > K) max = K;
+                if ((edge+limbFitWidth) > K-1) max = K-1;
                 else max = edge+limbFitWidth;
                
                 //if that neighborhood is large enough
@@ -904,14 +1966,12 @@ int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossing
                     return -1;
                 }
                 //compute fit to neighborhood
-                x.clear(); y.clear();
+                edgeFit.Reset();
                 for (int l = min; l <= max; l++)
-                {
-                    x.push_back(l-edge);
-                    y.push_back((float) chord.at<unsigned char>(l));
-                }
-                LinearFit(x,y,fit);
-                fittedEdge = (lowerThreshold - fit[0])/fit[1] + edge;
+                    edgeFit.Add(l-edge, pixels[l]);
+                if (!edgeFit.Solve(intercept, slope))
+                    return -2;
+                fittedEdge = (lowerThreshold - intercept)/slope + edge;
                
                 if (!std::isfinite(fittedEdge))
                 {
@@ -927,7 +1987,7 @@ int Aspect::FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossing
                 {
                     //std::cout << "Refined an edge" << std::endl;
                     crossings.push_back(fittedEdge);
-                    slopes.push_back(fabs(fit[1]));
+                    edgeSlopes.push_back(fabs(slope));
                 }
             }
         }
@@ -949,10 +2009,11 @@ void Aspect::FindPixelCenter()
 {
     cv::Mat input;
     std::vector<int> rows, cols;
-    std::vector<float> crossings, midpoints;
+    std::vector<float> midpoints;
     float mean, std;
     int rowStart, colStart, rowStep, colStep, limit, K, M;
     cv::Range rowRange, colRange;
+    cv::Point2i chordOffset(0,0);
     int error, infinite, outOfBounds;
     infinite = 0;
     outOfBounds = 0;
@@ -962,44 +2023,103 @@ void Aspect::FindPixelCenter()
                    !std::isfinite(pixelCenter.x) || !std::isfinite(pixelCenter.y) ||
                    solarImage.empty());
 
-    //Circle sun;
+    Circle sun;
 
     rows.clear();
     cols.clear();
 
     //Determine new row and column locations for chords
-    //If the past center was invalid, search the whole frame
-    if (search)
+    //If the past center was invalid, search the whole frame, or just the
+    //window where a coarse look at the frame finds the disk
+    if (search && acquisitionLevels > 0)
+    {
+        if (!AcquireSun(rowRange, colRange))
+        {
+            //No disk anywhere, so there are no limbs to find
+            pixelCenter = cv::Point2f(0,0);
+            limbCrossings.clear();
+            slopes.clear();
+            fitCrossings.clear();
+            return;
+        }
+        input = frame(rowRange, colRange);
+        chordOffset = cv::Point2i(colRange.start, rowRange.start);
+        limit = chordsPerAxis;
+    }
+    else if (search)
     {
         //std::cout << "Aspect: Finding new center" << std::endl;
         input = frame;
         limit = initialNumChords;
     }
+    else if (usePrediction)
+    {
+        //Only read the predicted disk, plus a margin for the prediction error
+        int margin = PREDICTOR_SIGMAS*predictedSigma;
+        if (margin < PREDICTOR_MIN_MARGIN) margin = PREDICTOR_MIN_MARGIN;
+        if (margin > solarRadius*radiusMargin) margin = solarRadius*radiusMargin;
+        rowRange = SafeRange(predictedCenter.y - solarRadius - margin,
+                             predictedCenter.y + solarRadius + margin + 1,
+                             frameSize.height);
+        colRange = SafeRange(predictedCenter.x - solarRadius - margin,
+                             predictedCenter.x + solarRadius + margin + 1,
+                             frameSize.width);
+        input = frame(rowRange, colRange);
+        chordOffset = cv::Point2i(colRange.start, rowRange.start);
+        limit = chordsPerAxis;
+    }
     else
     {
         //std::cout << "Aspect: Using old center" << std::endl;
         input = solarImage;
+        chordOffset = solarImageOffset;
         limit = chordsPerAxis;
     }
+
+    //Generate vectors of chord locations
+    //std::cout << "Aspect: Generating chord location list" << std::endl;
+    if (usePrediction && !search)
+    {
+        //Spread the chords across the predicted disk
+        float span = CHORD_SPAN*solarRadius;
+        for (int k = 0; k < limit; k++)
+        {
+            float position = -span + (2*k + 1)*span/limit;
+            int row = round(predictedCenter.y + position) - chordOffset.y;
+            int col = round(predictedCenter.x + position) - chordOffset.x;
+            if (row >= 0 && row < input.rows) rows.push_back(row);
+            if (col >= 0 && col < input.cols) cols.push_back(col);
+        }
+    }
+    else
+    {
         rowStep = input.rows/limit;
         colStep = input.cols/limit;
 
         rowStart = rowStep/2;
         colStart = colStep/2;
 
-    //Generate vectors of chord locations
-    //std::cout << "Aspect: Generating chord location list" << std::endl;
-    for (int k = 0; k < limit; k++)
-    {
-        //std::cout << rowStart + k*rowStep << " " << colStart + k*colStep << std::endl;
-        rows.push_back(rowStart + k*rowStep);
-        cols.push_back(colStart + k*colStep);
+        for (int k = 0; k < limit; k++)
+        {
+            //std::cout << rowStart + k*rowStep << " " << colStart + k*colStep << std::endl;
+            rows.push_back(rowStart + k*rowStep);
+            cols.push_back(colStart + k*colStep);
+        }
     }
 
+    //The pixel type is settled once here, so every chord is scanned by
+    //code built for it
+    if (input.depth() == CV_16U)
+        ScanChords<unsigned short>(input, rows, cols);
+    else
+        ScanChords<unsigned char>(input, rows, cols);
+
     //Initialize
     pixelCenter = cv::Point2f(0,0);
     limbCrossings.clear();
     slopes.clear();
+    fitCrossings.clear();
+    limbFit.Reset(cv::Point2f(input.cols/2, input.rows/2));
 
     //For each dimension
     for (int dim = 0; dim < 2; dim++)
@@ -1014,10 +2134,11 @@ void Aspect::FindPixelCenter()
         midpoints.clear();
         for (int k = 0; k < K; k++)
         {
-            //Determine the limb crossings in that chord
-            crossings.clear();
-            if (dim) error = FindLimbCrossings(input.row(rows[k]), crossings);
-            else error = FindLimbCrossings(input.col(cols[k]), crossings);
+            //The limb crossings in that chord
+            ChordResult &chord = chordResults[dim ? chordColCount + k : k];
+            std::vector<float> &crossings = chord.crossings;
+            error = chord.error;
+            slopes.insert(slopes.end(), chord.slopes.begin(), chord.slopes.end());
             
             //Skip this chord if the crossings had some error
             if (error == -1)
@@ -1048,8 +2169,7 @@ void Aspect::FindPixelCenter()
                 // Check if first limb is a virtual one, and reject the chord if it's not at the sensor edge
                 if (crossings[0] == -1) {
                     //std::cout << "Crossing == -1: " << dim << " " << solarImageOffset << " " << input.size() << " " << frame.size() << std::endl;
-                    if ((dim ? (!search)*solarImageOffset.x
-                             : (!search)*solarImageOffset.y) > 0) {
+                    if ((dim ? chordOffset.x : chordOffset.y) > 0) {
                         //std::cout << "  Reject\n";
                         continue;
                     }
@@ -1057,8 +2177,8 @@ void Aspect::FindPixelCenter()
                 // Check if second limb is a virtual one, and reject the chord if it's not at the sensor edge
                 if (crossings[1] == (dim ? input.cols : input.rows)) {
                     //std::cout << "Crossing == K: " << dim << " " << solarImageOffset << " " << input.size() << " " << frame.size() << std::endl;
-                    if ((dim ? (!search)*solarImageOffset.x+input.cols < frame.cols
-                             : (!search)*solarImageOffset.y+input.rows < frame.rows)) {
+                    if ((dim ? chordOffset.x+input.cols < frame.cols
+                             : chordOffset.y+input.rows < frame.rows)) {
                         //std::cout << "  Reject\n";
                         continue;
                     }
@@ -1068,6 +2188,15 @@ void Aspect::FindPixelCenter()
                 {
                     if (dim) limbCrossings.add(crossings[l], rows[k]);
                     else limbCrossings.add(cols[k], crossings[l]);
+
+                    //The sensor edge is not on the limb, so virtual
+                    //crossings stay out of the circle fit
+                    if (centerMethod == CENTER_CIRCLE_FIT &&
+                        crossings[l] != -1 && crossings[l] != (dim ? input.cols : input.rows))
+                    {
+                        fitCrossings.push_back(limbCrossings.back());
+                        limbFit.Add(limbCrossings.back());
+                    }
                 }
                 midpoints.push_back((crossings[0]+crossings[1])/2.0);
             }
@@ -1101,196 +2230,1040 @@ void Aspect::FindPixelCenter()
             pixelError.y = std;
         }       
     }
-    
-    //Dying to use this. Does a least squares fit to limb crossings instead of using chord midpoints.
-    //CircleFit(limbCrossings, sun);
-    //pixelCenter = sun.center();
-    
+    
+    //Least squares fit to the limb crossings instead of using chord
+    //midpoints. Keeps the midpoint center if the fit fails.
+    if (centerMethod == CENTER_CIRCLE_FIT && RejectOutliers(limbFit, fitCrossings, sun))
+    {
+        pixelCenter = sun.center();
+        pixelError = limbFit.CenterError();
+    }
+
+
+    //std::cout << "Infinite error: " << infinite << ", Out of Bounds errors: " << outOfBounds << std::endl;
+    //std::cout << "Aspect: Leaving FindPixelCenter" << std::endl;
+    if (chordOffset != cv::Point2i(0,0))
+    {
+        pixelCenter.y = pixelCenter.y + (float) chordOffset.y;
+        pixelCenter.x = pixelCenter.x + (float) chordOffset.x;
+        for (int k = 0; k < limbCrossings.size(); k++)
+        {
+            limbCrossings[k].y = limbCrossings[k].y + chordOffset.y;
+            limbCrossings[k].x = limbCrossings[k].x + chordOffset.x;
+        }
+    }
+
+    return;
+}
+
+//ThresholdMoments of an 8 or 16-bit image
+static void MatMoments(const cv::Mat &image, int threshold,
+                       long long &count, long long &sumCol, long long &sumRow)
+{
+    if (image.depth() == CV_16U)
+        ThresholdMoments(image.ptr<unsigned short>(0), image.rows, image.cols, image.step,
+                         (unsigned short) threshold, count, sumCol, sumRow);
+    else
+        ThresholdMoments(image.ptr<unsigned char>(0), image.rows, image.cols, image.step,
+                         (unsigned char) threshold, count, sumCol, sumRow);
+}
+
+bool Aspect::FindMomentCenter(cv::Point2f around, cv::Point2f &centroid, bool &clipped)
+{
+    cv::Range rowRange, colRange;
+    long long count, sumCol, sumRow, edgeCount, edgeCol, edgeRow;
+    int reach = solarRadius*(1 + radiusMargin);
+
+    //The same size window as the solar subimage
+    rowRange = SafeRange(around.y - reach, around.y + reach, frameSize.height);
+    colRange = SafeRange(around.x - reach, around.x + reach, frameSize.width);
+    if (rowRange.end - rowRange.start < 3 || colRange.end - colRange.start < 3)
+        return false;
+    cv::Mat window = frame(rowRange, colRange);
+
+    int threshold = frameMin + diskThreshold*(frameMax-frameMin);
+    MatMoments(window, threshold, count, sumCol, sumRow);
+    if (count == 0) return false;
+
+    centroid.x = (float) sumCol/count + colRange.start;
+    centroid.y = (float) sumRow/count + rowRange.start;
+
+    //Disk on an edge of the window. Like a virtual limb crossing, that's
+    //only allowed where the window edge is the sensor edge, and then the
+    //centroid is pulled towards the middle of the sensor.
+    clipped = false;
+    for (int side = 0; side < 4; side++)
+    {
+        cv::Mat edge;
+        bool sensorEdge;
+        switch (side)
+        {
+        case 0:
+            edge = window.row(0);
+            sensorEdge = (rowRange.start == 0);
+            break;
+        case 1:
+            edge = window.row(window.rows - 1);
+            sensorEdge = (rowRange.end == frameSize.height);
+            break;
+        case 2:
+            edge = window.col(0);
+            sensorEdge = (colRange.start == 0);
+            break;
+        default:
+            edge = window.col(window.cols - 1);
+            sensorEdge = (colRange.end == frameSize.width);
+            break;
+        }
+
+        MatMoments(edge, threshold, edgeCount, edgeCol, edgeRow);
+        if (edgeCount == 0) continue;
+        if (!sensorEdge) return false;
+        clipped = true;
+    }
+    return true;
+}
+
+//Count, centroid sums and bounding box of the pixels of an image above
+//threshold. The box is empty (min > max) if there are none.
+template <typename Pixel>
+static void BrightRegion(const cv::Mat &image, int threshold, int &count,
+                         long &sumRow, long &sumCol,
+                         int &minRow, int &maxRow, int &minCol, int &maxCol)
+{
+    count = 0;
+    sumRow = sumCol = 0;
+    minRow = image.rows; maxRow = -1;
+    minCol = image.cols; maxCol = -1;
+    for (int m = 0; m < image.rows; m++)
+    {
+        const Pixel *pixels = image.ptr<Pixel>(m);
+        for (int n = 0; n < image.cols; n++)
+        {
+            if (pixels[n] > threshold)
+            {
+                count++;
+                sumRow += m;
+                sumCol += n;
+                if (n < minCol) minCol = n;
+                if (n > maxCol) maxCol = n;
+                if (m < minRow) minRow = m;
+                if (m > maxRow) maxRow = m;
+            }
+        }
+    }
+}
+
+bool Aspect::AcquireSun(cv::Range &rowRange, cv::Range &colRange)
+{
+    int levels, scale, count, reach;
+    long sumRow, sumCol;
+    int minRow, maxRow, minCol, maxCol;
+    cv::Point2f center;
+
+    //Halve the frame until it is small enough to scan whole
+    pyramid.resize(acquisitionLevels);
+    const cv::Mat *level = &frame;
+    for (levels = 0; levels < acquisitionLevels; levels++)
+    {
+        if (level->rows < 2 || level->cols < 2) break;
+        pyramid[levels].create(level->rows/2, level->cols/2, frame.type());
+        if (frame.depth() == CV_16U)
+            Downsample2x(level->ptr<unsigned short>(0), level->rows, level->cols, level->step,
+                         pyramid[levels].ptr<unsigned short>(0), pyramid[levels].step);
+        else
+            Downsample2x(level->ptr<unsigned char>(0), level->rows, level->cols, level->step,
+                         pyramid[levels].ptr<unsigned char>(0), pyramid[levels].step);
+        level = &pyramid[levels];
+    }
+    scale = 1 << levels;
+
+    //Pixels bright enough to be on the disk, as in FindLimbCrossings
+    int threshold = frameMin + diskThreshold*(frameMax-frameMin);
+    if (frame.depth() == CV_16U)
+        BrightRegion<unsigned short>(*level, threshold, count, sumRow, sumCol,
+                                     minRow, maxRow, minCol, maxCol);
+    else
+        BrightRegion<unsigned char>(*level, threshold, count, sumRow, sumCol,
+                                    minRow, maxRow, minCol, maxCol);
+
+    if ((double) count*scale*scale < ACQUISITION_MIN_AREA*pi*solarRadius*solarRadius)
+        return false;
+
+    //The bounding box of the bright pixels holds the disk, even if it's
+    //partly off the frame, as long as nothing else is bright. If it is too
+    //big for the disk, go by the centroid.
+    reach = solarRadius*(1 + radiusMargin);
+    if ((maxRow - minRow + 1)*scale <= 2*reach && (maxCol - minCol + 1)*scale <= 2*reach)
+    {
+        //The box is drawn at diskThreshold, but the chords find the limb at
+        //limbThreshold, further out by the limb darkening and blur. Pad it
+        //by the same radius margin as the centroid window, so the chords
+        //start below limbThreshold.
+        int margin = scale + limbFitWidth + solarRadius*radiusMargin;
+        rowRange = SafeRange(minRow*scale - margin,
+                             (maxRow + 1)*scale + margin, frame.rows);
+        colRange = SafeRange(minCol*scale - margin,
+                             (maxCol + 1)*scale + margin, frame.cols);
+    }
+    else
+    {
+        center.y = ((float) sumRow/count + 0.5)*scale;
+        center.x = ((float) sumCol/count + 0.5)*scale;
+        rowRange = SafeRange(center.y - reach, center.y + reach + 1, frame.rows);
+        colRange = SafeRange(center.x - reach, center.x + reach + 1, frame.cols);
+    }
+    return rowRange.end - rowRange.start > 2 && colRange.end - colRange.start > 2;
+}
+
+void Aspect::Correlate(const cv::Mat &image, cv::Mat &correlation, bool masked)
+{
+    cv::Mat input;
+
+    //The fixed point sums are sized for 8-bit pixels
+    if (correlationMode == CORRELATION_INTEGER && image.depth() == CV_8U)
+    {
+        correlation.create(image.rows - kernel.rows + 1, image.cols - kernel.cols + 1, CV_32FC1);
+        CorrelateBands(image, correlation, masked);
+        return;
+    }
+
+    image.convertTo(input, CV_32FC1);
+    min(input, frameMax, input);
+
+    if (correlationMode == CORRELATION_SEPARABLE && kernelRowFactors.size() > 0)
+    {
+        cv::Mat pass;
+        //sepFilter2D anchors the kernel at its center and pads the border;
+        //crop to the part matchTemplate would have produced
+        cv::Rect valid(kernel.cols/2, kernel.rows/2,
+                       input.cols - kernel.cols + 1, input.rows - kernel.rows + 1);
+        correlation = cv::Mat::zeros(valid.height, valid.width, CV_32FC1);
+        for (unsigned int r = 0; r < kernelRowFactors.size(); r++)
+        {
+            cv::sepFilter2D(input, pass, CV_32F, kernelRowFactors[r], kernelColFactors[r],
+                            cv::Point(-1,-1), 0, cv::BORDER_REPLICATE);
+            correlation += pass(valid);
+        }
+    }
+    else
+    {
+        correlation.create(input.rows - kernel.rows + 1, input.cols - kernel.cols + 1, CV_32FC1);
+        CorrelateBands(input, correlation, masked);
+    }
+}
+
+void Aspect::CorrelateBands(const cv::Mat &image, cv::Mat &correlation, bool masked)
+{
+    //Bands of output rows are independent, so the workers can each take
+    //some. Every band rereads kernel.rows-1 image rows of the next one, so
+    //bands are kept tall.
+    bandImage = &image;
+    bandOutput = &correlation;
+    bandMasked = masked && (int) corrSpanStart.size() == correlation.rows;
+    int threads = (pool != NULL) ? pool->GetNumThreads() : 1;
+    bandCount = correlation.rows/MIN_BAND_ROWS;
+    if (bandCount > 2*threads) bandCount = 2*threads;
+    if (bandCount < 1) bandCount = 1;
+    RunTasks(CorrelateTask, bandCount);
+}
+
+void Aspect::CorrelateTask(void *arg, int band)
+{
+    Aspect *aspect = (Aspect *) arg;
+    const cv::Mat &image = *aspect->bandImage;
+    cv::Mat &correlation = *aspect->bandOutput;
+    const cv::Mat &kernel = aspect->kernel;
+    int start = band*correlation.rows/aspect->bandCount;
+    int stop = (band + 1)*correlation.rows/aspect->bandCount;
+    if (stop <= start) return;
+
+    if (aspect->bandMasked)
+    {
+        const int *spanStart = &aspect->corrSpanStart[0];
+        const int *spanStop = &aspect->corrSpanStop[0];
+        if (image.type() == CV_8UC1)
+        {
+            //The kernel sums are per output pixel, so each span is its own
+            //one-row correlation
+            for (int m = start; m < stop; m++)
+            {
+                if (spanStop[m] <= spanStart[m]) continue;
+                CorrelateKernel16(image.ptr<unsigned char>(m) + spanStart[m], kernel.rows,
+                                  spanStop[m] - spanStart[m] + kernel.cols - 1,
+                                  image.step, (unsigned char) aspect->frameMax,
+                                  &aspect->kernelQuantized[0], kernel.rows, kernel.cols,
+                                  KERNEL_SCALE, correlation.ptr<float>(m) + spanStart[m],
+                                  correlation.step/sizeof(float));
+            }
+        }
+        else
+        {
+            //matchTemplate has a setup cost per call, so it takes the
+            //columns covering every span in the band at once
+            int colStart = correlation.cols, colStop = 0;
+            for (int m = start; m < stop; m++)
+            {
+                if (spanStop[m] <= spanStart[m]) continue;
+                colStart = std::min(colStart, spanStart[m]);
+                colStop = std::max(colStop, spanStop[m]);
+            }
+            if (colStop <= colStart) return;
+            cv::Mat output = correlation(cv::Range(start, stop), cv::Range(colStart, colStop));
+            matchTemplate(image(cv::Range(start, stop + kernel.rows - 1),
+                                cv::Range(colStart, colStop + kernel.cols - 1)),
+                          kernel, output, CV_TM_CCORR);
+        }
+        return;
+    }
+
+    if (image.type() == CV_8UC1)
+    {
+        //Clamps to frameMax as it reads, so no float copy of the image
+        CorrelateKernel16(image.ptr<unsigned char>(start), stop - start + kernel.rows - 1,
+                          image.cols, image.step, (unsigned char) aspect->frameMax,
+                          &aspect->kernelQuantized[0], kernel.rows, kernel.cols, KERNEL_SCALE,
+                          correlation.ptr<float>(start), correlation.step/sizeof(float));
+    }
+    else
+    {
+        //Same size and type, so matchTemplate writes straight into the band
+        cv::Mat output = correlation.rowRange(start, stop);
+        matchTemplate(image.rowRange(start, stop + kernel.rows - 1), kernel, output, CV_TM_CCORR);
+    }
+}
+
+void Aspect::BuildDiskSpans(int rows, int cols, cv::Point2f center, float radius,
+                            std::vector<int> &start, std::vector<int> &stop)
+{
+    float dy, half;
+
+    //Empty spans are stored as start == stop, at a valid column
+    start.resize(rows);
+    stop.resize(rows);
+    for (int m = 0; m < rows; m++)
+    {
+        dy = m - center.y;
+        start[m] = stop[m] = 0;
+        if (std::abs(dy) > radius)
+            continue;
+        half = std::sqrt(radius*radius - dy*dy);
+        start[m] = std::min(std::max((int) std::ceil(center.x - half), 0), cols);
+        stop[m] = std::max(std::min((int) std::floor(center.x + half) + 1, cols), start[m]);
+    }
+}
+
+void Aspect::FindPeaks(const cv::Mat &correlation, float threshold,
+                       int rowStart, int rowStop, std::vector<cv::Point> &peaks,
+                       const int *spanStart, const int *spanStop)
+{
+    int colStart, colStop;
+    float thisValue;
+    const float *above, *row, *below;
+
+    peaks.clear();
+    if (rowStart < 1) rowStart = 1;
+    if (rowStop > correlation.rows-1) rowStop = correlation.rows-1;
+
+    for (int m = rowStart; m < rowStop; m++)
+    {
+        above = correlation.ptr<float>(m - 1);
+        row = correlation.ptr<float>(m);
+        below = correlation.ptr<float>(m + 1);
+        colStart = 1;
+        colStop = correlation.cols-1;
+        if (spanStart != NULL)
+        {
+            colStart = std::max(colStart, spanStart[m]);
+            colStop = std::min(colStop, spanStop[m]);
+        }
+        for (int n = colStart; n < colStop; n++)
+        {
+            thisValue = row[n];
+            if(thisValue > threshold)
+            {
+                if((thisValue > row[n + 1]) &
+                   (thisValue > row[n - 1]) &
+                   (thisValue > below[n]) &
+                   (thisValue > above[n]))
+                    peaks.push_back(cv::Point(n, m));
+            }
+        }
+    }
+}
+
+void Aspect::TileStatsTask(void *arg, int tile)
+{
+    Aspect *aspect = (Aspect *) arg;
+    const cv::Mat &correlation = *aspect->tileCorrelation;
+    int start = tile*FIDUCIAL_TILE_ROWS;
+    int stop = std::min(start + FIDUCIAL_TILE_ROWS, correlation.rows);
+    double sum = 0, sumSquares = 0;
+
+    for (int m = start; m < stop; m++)
+    {
+        const float *row = correlation.ptr<float>(m);
+        for (int n = 0; n < correlation.cols; n++)
+        {
+            sum += row[n];
+            sumSquares += (double) row[n]*row[n];
+        }
+    }
+    aspect->tileSums[tile] = sum;
+    aspect->tileSquares[tile] = sumSquares;
+}
+
+void Aspect::TilePeaksTask(void *arg, int tile)
+{
+    Aspect *aspect = (Aspect *) arg;
+    int start = tile*FIDUCIAL_TILE_ROWS;
+    aspect->FindPeaks(*aspect->tileCorrelation, aspect->tileThreshold,
+                      start, start + FIDUCIAL_TILE_ROWS, aspect->tilePeaks[tile],
+                      aspect->tileSpanStart, aspect->tileSpanStop);
+}
+
+void Aspect::SelectFiducials(const cv::Mat &correlation, const std::vector<cv::Point> &peaks)
+{
+    //FIDUCIAL_LENGTH can be commanded to anything, so keep the cells at
+    //least a pixel across
+    int cellSize = (fiducialLength > 0) ? 2*fiducialLength : 1;
+    int gridCols = correlation.cols/cellSize + 1;
+    int gridRows = correlation.rows/cellSize + 1;
+    int numSlots = 0, slot, cell, minSlot;
+    int m, n, cm, cn;
+    float thisValue;
+
+    //Fiducials are kept in numFiducials slots. Each slot is linked into the
+    //grid cell holding it, so a peak only has to be checked against the
+    //slots in the 3x3 cells around it. A min-heap of the slots, ordered by
+    //correlation value and then slot number, gives the weakest slot.
+    if (numFiducials <= 0)
+    {
+        pixelFiducials.clear();
+        return;
+    }
+    gridHead.assign(gridRows*gridCols, -1);
+    slotNext.resize(numFiducials);
+    slotPosition.resize(numFiducials);
+    slotValue.resize(numFiducials);
+    slotHeap.clear();
+    slotHeapIndex.resize(numFiducials);
+
+    for (unsigned int p = 0; p < peaks.size(); p++)
+    {
+        n = peaks[p].x;
+        m = peaks[p].y;
+        thisValue = correlation.at<float>(m, n);
+        cn = n/cellSize;
+        cm = m/cellSize;
+
+        //A peak within cellSize of a slot is a redundant detection of the
+        //same fiducial. It is checked against the lowest numbered such slot.
+        minSlot = -1;
+        for (int i = (cm > 0 ? cm - 1 : 0); i <= cm + 1 && i < gridRows; i++)
+        {
+            for (int j = (cn > 0 ? cn - 1 : 0); j <= cn + 1 && j < gridCols; j++)
+            {
+                for (slot = gridHead[i*gridCols + j]; slot >= 0; slot = slotNext[slot])
+                {
+                    if (abs(slotPosition[slot].y - m) < cellSize &&
+                        abs(slotPosition[slot].x - n) < cellSize &&
+                        (minSlot < 0 || slot < minSlot))
+                        minSlot = slot;
+                }
+            }
+        }
+
+        if (minSlot >= 0)
+        {
+            if (thisValue > slotValue[minSlot])
+                MoveSlot(minSlot, peaks[p], thisValue, gridCols, cellSize);
+            continue;
+        }
+
+        if (numSlots < numFiducials)
+        {
+            slot = numSlots++;
+            slotPosition[slot] = peaks[p];
+            slotValue[slot] = thisValue;
+            cell = cm*gridCols + cn;
+            slotNext[slot] = gridHead[cell];
+            gridHead[cell] = slot;
+
+            slotHeap.push_back(slot);
+            slotHeapIndex[slot] = slotHeap.size() - 1;
+            SiftUp(slotHeap.size() - 1);
+        }
+        else if (thisValue > slotValue[slotHeap[0]])
+        {
+            MoveSlot(slotHeap[0], peaks[p], thisValue, gridCols, cellSize);
+        }
+    }
+
+    pixelFiducials.clear();
+    for (slot = 0; slot < numSlots; slot++)
+        pixelFiducials.add(slotPosition[slot].x, slotPosition[slot].y);
+}
+
+//Moves a fiducial slot to a stronger peak, keeping the grid and heap current
+void Aspect::MoveSlot(int slot, cv::Point position, float value, int gridCols, int cellSize)
+{
+    int oldCell = (slotPosition[slot].y/cellSize)*gridCols + slotPosition[slot].x/cellSize;
+    int newCell = (position.y/cellSize)*gridCols + position.x/cellSize;
+
+    if (oldCell != newCell)
+    {
+        int *link = &gridHead[oldCell];
+        while (*link != slot)
+            link = &slotNext[*link];
+        *link = slotNext[slot];
+        slotNext[slot] = gridHead[newCell];
+        gridHead[newCell] = slot;
+    }
+    slotPosition[slot] = position;
+
+    //The value only ever goes up
+    slotValue[slot] = value;
+    SiftDown(slotHeapIndex[slot]);
+}
+
+bool Aspect::SlotLess(int a, int b)
+{
+    return (slotValue[a] < slotValue[b]) || (slotValue[a] == slotValue[b] && a < b);
+}
+
+void Aspect::SiftUp(int index)
+{
+    int parent;
+    while (index > 0)
+    {
+        parent = (index - 1)/2;
+        if (!SlotLess(slotHeap[index], slotHeap[parent])) break;
+        std::swap(slotHeap[index], slotHeap[parent]);
+        slotHeapIndex[slotHeap[index]] = index;
+        slotHeapIndex[slotHeap[parent]] = parent;
+        index = parent;
+    }
+}
+
+void Aspect::SiftDown(int index)
+{
+    int child, size = slotHeap.size();
+    while ((child = 2*index + 1) < size)
+    {
+        if (child + 1 < size && SlotLess(slotHeap[child + 1], slotHeap[child]))
+            child++;
+        if (!SlotLess(slotHeap[child], slotHeap[index])) break;
+        std::swap(slotHeap[index], slotHeap[child]);
+        slotHeapIndex[slotHeap[index]] = index;
+        slotHeapIndex[slotHeap[child]] = child;
+        index = child;
+    }
+}
+
+void Aspect::FindPixelFiducials(bool masked)
+{
+    cv::Scalar mean, stddev;
+    cv::Mat correlation;
+    cv::Point2f offset;
+    float threshold;
+    const int *spanStart = NULL, *spanStop = NULL;
+    timespec refineStart, refineStop;
+
+    //Try following last frame's fiducials first, and only search the whole
+    //subimage if that fails
+    if (trackFiducials && TrackPixelFiducials())
+        return;
+
+    pixelFiducials.clear();
+
+    //cv::namedWindow("Correlation", CV_WINDOW_NORMAL | CV_WINDOW_KEEPRATIO | CV_GUI_EXPANDED );
+
+    offset.x = solarImageOffset.x + (kernel.cols/2);
+    offset.y = solarImageOffset.y + (kernel.rows/2);
+
+    //A correlation pixel is a kernel placement centered at pixel + offset
+    //in the frame, and only placements on the disk can find a fiducial
+    if (masked)
+    {
+        int corrRows = solarImage.rows - kernel.rows + 1;
+        int corrCols = solarImage.cols - kernel.cols + 1;
+        BuildDiskSpans(corrRows, corrCols, pixelCenter - offset, solarRadius + 1,
+                       corrSpanStart, corrSpanStop);
+        BuildDiskSpans(corrRows, corrCols, pixelCenter - offset, solarRadius,
+                       searchSpanStart, searchSpanStop);
+    }
+
+    Correlate(solarImage, correlation, masked);
+    int tiles = (correlation.rows + FIDUCIAL_TILE_ROWS - 1)/FIDUCIAL_TILE_ROWS;
+
+    //cv::waitKey(0);
+    if (masked)
+    {
+        //Statistics over the disk only. Everything off the disk is set
+        //below any threshold, so refinement never picks it up.
+        double sum = 0, sumSquares = 0;
+        long long count = 0;
+        const float lowest = -std::numeric_limits<float>::max();
+        for (int m = 0; m < correlation.rows; m++)
+        {
+            float *row = correlation.ptr<float>(m);
+            std::fill(row, row + corrSpanStart[m], lowest);
+            std::fill(row + corrSpanStop[m], row + correlation.cols, lowest);
+            for (int n = searchSpanStart[m]; n < searchSpanStop[m]; n++)
+            {
+                sum += row[n];
+                sumSquares += (double) row[n]*row[n];
+            }
+            count += searchSpanStop[m] - searchSpanStart[m];
+        }
+        if (count == 0)
+            return;
+        double average = sum/count;
+        mean = cv::Scalar(average);
+        stddev = cv::Scalar(std::sqrt(std::max(sumSquares/count - average*average, 0.0)));
+        spanStart = &searchSpanStart[0];
+        spanStop = &searchSpanStop[0];
+    }
+    else
+    {
+        double sum = 0, sumSquares = 0;
+        long long count = (long long) correlation.rows*correlation.cols;
+        tileCorrelation = &correlation;
+        tileSums.assign(tiles, 0);
+        tileSquares.assign(tiles, 0);
+        RunTasks(TileStatsTask, tiles);
+        for (int t = 0; t < tiles; t++)
+        {
+            sum += tileSums[t];
+            sumSquares += tileSquares[t];
+        }
+        double average = (count > 0) ? sum/count : 0;
+        mean = cv::Scalar(average);
+        stddev = cv::Scalar((count > 0) ?
+                            std::sqrt(std::max(sumSquares/count - average*average, 0.0)) : 0);
+    }
+    correlationMean = mean[0];
+    correlationStddev = stddev[0];
 
-    //std::cout << "Infinite error: " << infinite << ", Out of Bounds errors: " << outOfBounds << std::endl;
-    //std::cout << "Aspect: Leaving FindPixelCenter" << std::endl;
-    if (!search)
+    threshold = mean[0] + fiducialThreshold*stddev[0];
+
+    //Each tile finds its own peaks, reading the rows either side of it
+    //from the shared correlation, so there are no seams. Putting them
+    //together in tile order keeps the raster order of a single scan.
+    tileCorrelation = &correlation;
+    tileThreshold = threshold;
+    tileSpanStart = spanStart;
+    tileSpanStop = spanStop;
+    tilePeaks.resize(tiles);
+    RunTasks(TilePeaksTask, tiles);
+    peakCandidates.clear();
+    for (int t = 0; t < tiles; t++)
+        peakCandidates.insert(peakCandidates.end(), tilePeaks[t].begin(), tilePeaks[t].end());
+    SelectFiducials(correlation, peakCandidates);
+
+    //Refine positions to sub-pixel, then add an offset to convert from
+    //the solar subimage to the original frame
+    threshold = mean[0] + (fiducialThreshold/2)*stddev[0];
+    clock_gettime(CLOCK_MONOTONIC, &refineStart);
+    RefinePeaks(correlation, threshold);
+    clock_gettime(CLOCK_MONOTONIC, &refineStop);
+    refineStop = TimespecDiff(refineStart, refineStop);
+    refineTime = refineStop.tv_sec*1e3 + refineStop.tv_nsec/1e6;
+    for (unsigned int k = 0; k <  pixelFiducials.size(); k++)
+        pixelFiducials[k] += offset;
+
+    for (int k = 0; k < pixelFiducials.size(); k++)
     {
-        pixelCenter.y = pixelCenter.y + (float) solarImageOffset.y;
-        pixelCenter.x = pixelCenter.x + (float) solarImageOffset.x;
-        for (int k = 0; k < limbCrossings.size(); k++)
-        {
-            limbCrossings[k].y = limbCrossings[k].y + solarImageOffset.y;
-            limbCrossings[k].x = limbCrossings[k].x + solarImageOffset.x;
-        }
-    }
+        if(!std::isfinite(pixelFiducials[k].x) || !std::isfinite(pixelFiducials[k].y))
+            pixelFiducials.erase(pixelFiducials.begin() + k);
 
+    }
     return;
 }
 
-void Aspect::FindPixelFiducials()
+bool Aspect::TrackPixelFiducials()
 {
-    cv::Mat input;
-    cv::Scalar mean, stddev;
-    cv::Size imageSize;
-    cv::Mat correlation, nbhd;
+    cv::Mat window, patch;
     cv::Range rowRange, colRange;
-    cv::Point2f offset;
-    float threshold, thisValue, thatValue, minValue;
-    float Cm, Cn, average;
-    int minIndex;
-    bool redundant;
+    cv::Point2f offset, predicted, refined;
+    cv::Point peak;
+    double peakValue;
+    float threshold, refineThreshold;
+    int corrRows = solarImage.rows - kernel.rows + 1;
+    int corrCols = solarImage.cols - kernel.cols + 1;
+    int half = fiducialTrackWindow + fiducialWidth + 1;
+
+    //Fiducials are fixed on the screen, and the screen is fixed to the
+    //camera, so they stay where they were in the frame however the sun
+    //moves. Only the solar subimage they are searched in moves with it.
+    offset.x = solarImageOffset.x + (kernel.cols/2);
+    offset.y = solarImageOffset.y + (kernel.rows/2);
+
+    //Same thresholds as the last full search
+    threshold = correlationMean + fiducialThreshold*correlationStddev;
+    refineThreshold = correlationMean + (fiducialThreshold/2)*correlationStddev;
 
     pixelFiducials.clear();
-    solarImage.convertTo(input, CV_32FC1);
-    correlation.create(solarImage.size(), CV_32FC1);
+    for (unsigned int k = 0; k < lastFiducials.size(); k++)
+    {
+        //Last position, in correlation coordinates
+        predicted = lastFiducials[k] - offset;
+        rowRange = SafeRange(round(predicted.y) - half, round(predicted.y) + half + 1, corrRows);
+        colRange = SafeRange(round(predicted.x) - half, round(predicted.x) + half + 1, corrCols);
+        if (rowRange.end - rowRange.start < 3 || colRange.end - colRange.start < 3)
+            return false;
+
+        //The image window covering every kernel placement in the range
+        window = solarImage(cv::Range(rowRange.start, rowRange.end + kernel.rows - 1),
+                            cv::Range(colRange.start, colRange.end + kernel.cols - 1));
+        Correlate(window, patch);
+
+        //A weak match, or a peak on the edge of the window (probably the
+        //flank of a stronger peak outside it), means we lost this fiducial
+        cv::minMaxLoc(patch, NULL, &peakValue, NULL, &peak);
+        if (peakValue <= threshold ||
+            peak.x == 0 || peak.y == 0 || peak.x == patch.cols-1 || peak.y == patch.rows-1)
+            return false;
+
+        refined = RefinePeak(patch, peak, refineThreshold);
+        refined.x += colRange.start + offset.x;
+        refined.y += rowRange.start + offset.y;
+        if (!std::isfinite(refined.x) || !std::isfinite(refined.y))
+            return false;
+
+        //Two windows locked onto the same fiducial
+        for (unsigned int j = 0; j < pixelFiducials.size(); j++)
+        {
+            if (std::abs(pixelFiducials[j].x - refined.x) < fiducialLength &&
+                std::abs(pixelFiducials[j].y - refined.y) < fiducialLength)
+                return false;
+        }
+        pixelFiducials.push_back(refined);
+    }
+    return pixelFiducials.size() > 0;
+}
 
-    //cv::namedWindow("Correlation", CV_WINDOW_NORMAL | CV_WINDOW_KEEPRATIO | CV_GUI_EXPANDED );
-    
-    min(input, frameMax, input);
+void Aspect::RefinePeaks(const cv::Mat &correlation, float threshold)
+{
+    unsigned int k, K = pixelFiducials.size();
 
-    //cv::normalize(input, input,0,1,cv::NORM_MINMAX);
-    //cv::imshow("Correlation", input);
+    if (fiducialRefine == REFINE_CENTROID)
+    {
+        for (k = 0; k < K; k++)
+            pixelFiducials[k] = RefinePeak(correlation,
+                                           cv::Point(pixelFiducials[k].x, pixelFiducials[k].y),
+                                           threshold);
+        return;
+    }
+    if (K == 0) return;
 
-    matchTemplate(input, kernel, correlation, CV_TM_CCORR);
+    //Fit every peak in one pass
+    peakRows.resize(K);
+    peakCols.resize(K);
+    peakOffsetX.resize(K);
+    peakOffsetY.resize(K);
+    for (k = 0; k < K; k++)
+    {
+        peakRows[k] = pixelFiducials[k].y;
+        peakCols[k] = pixelFiducials[k].x;
+    }
+    FitPeaks3x3(correlation.ptr<float>(0), correlation.rows, correlation.cols,
+                correlation.step/sizeof(float), &peakRows[0], &peakCols[0], K,
+                fiducialRefine == REFINE_GAUSSIAN, &peakOffsetX[0], &peakOffsetY[0]);
+    for (k = 0; k < K; k++)
+        pixelFiducials[k] = cv::Point2f(peakCols[k] + peakOffsetX[k],
+                                        peakRows[k] + peakOffsetY[k]);
+}
 
-    offset.x = solarImageOffset.x + (kernel.cols/2);
-    offset.y = solarImageOffset.y + (kernel.rows/2);
+cv::Point2f Aspect::RefinePeak(const cv::Mat &correlation, cv::Point peak, float threshold)
+{
+    cv::Range rowRange, colRange;
+    float thisValue;
+    float Cm, Cn, average;
+    float dx, dy;
 
+    if (fiducialRefine != REFINE_CENTROID)
+    {
+        FitPeaks3x3(correlation.ptr<float>(0), correlation.rows, correlation.cols,
+                    correlation.step/sizeof(float), &peak.y, &peak.x, 1,
+                    fiducialRefine == REFINE_GAUSSIAN, &dx, &dy);
+        return cv::Point2f(peak.x + dx, peak.y + dy);
+    }
 
-    //cv::waitKey(0);
-    cv::meanStdDev(correlation, mean, stddev);
+    //Get safe ranges for for the neighborhood around the fiducial
+    rowRange = SafeRange(peak.y - fiducialWidth, peak.y + fiducialWidth + 1, correlation.rows);
+    colRange = SafeRange(peak.x - fiducialWidth, peak.x + fiducialWidth + 1, correlation.cols);
 
-    threshold = mean[0] + fiducialThreshold*stddev[0];
-        
-    for (int m = 1; m < correlation.rows-1; m++)
+    //Compute the centroid of the region around the local max
+    //in the correlation image
+    Cm = 0.0; Cn = 0.0; average = 0.0;
+    for (int m = rowRange.start; m < rowRange.end; m++)
     {
-        for (int n = 1; n < correlation.cols-1; n++)
-        {        
+        for (int n = colRange.start; n < colRange.end; n++)
+        {
             thisValue = correlation.at<float>(m,n);
-            if(thisValue > threshold)
+            if (thisValue > threshold)
             {
-                if((thisValue > correlation.at<float>(m, n + 1)) &
-                   (thisValue > correlation.at<float>(m, n - 1)) &
-                   (thisValue > correlation.at<float>(m + 1, n)) &
-                   (thisValue > correlation.at<float>(m - 1, n)))
-                {
-                    redundant = false;
-                    for (unsigned int k = 0; k <  pixelFiducials.size(); k++)
-                    {
-                        if (abs(pixelFiducials[k].y - m) < fiducialLength*2 &&
-                            abs(pixelFiducials[k].x - n) < fiducialLength*2)
-                        {
-                            redundant = true;
-                            thatValue = correlation.at<float>((int) pixelFiducials[k].y,
-                                                              (int) pixelFiducials[k].x);
-                            if ( thisValue > thatValue)
-                            {
-                                pixelFiducials[k] = cv::Point2f(n,m);
-                            }
-                            break;
-                        }
-                    }
-                    if (redundant == true)
-                        continue;
-
-                    if ( (int) pixelFiducials.size() < numFiducials)
-                    {
-                        pixelFiducials.add(n, m);
-                    }
-                    else
-                    {
-                        minValue = std::numeric_limits<float>::infinity();;
-                        minIndex = -1;
-                        for (int k = 0; k < numFiducials; k++)
-                        {
-                            if (correlation.at<float>((int) pixelFiducials[k].y,
-                                                      (int) pixelFiducials[k].x) 
-                                < minValue)
-                            {
-                                minIndex = k;
-                                minValue = correlation.at<float>((int) pixelFiducials[k].y,
-                                                                 (int) pixelFiducials[k].x);
-                            }   
-                        }
-                        if (thisValue > minValue)
-                        {
-                            pixelFiducials[minIndex] = cv::Point2f(n, m);
-                        }
-                    }
-                }
+                Cm += ((float) m)*thisValue;
+                Cn += ((float) n)*thisValue;
+                average += thisValue;
             }
         }
     }
+    return cv::Point2f(Cn/average, Cm/average);
+}
 
-    //Refine positions to sub-pixel
-    //For each fiducial location
-    for (unsigned int k = 0; k <  pixelFiducials.size(); k++)
+void Aspect::BuildIDTable()
+{
+    float tol = fiducialSpacingTol;
+
+    mDistances.clear();
+    nDistances.clear();
+    for (int k = 0; k < 14; k++)
+    {
+        if(k < 7)
+        {
+            mDistances.push_back((84-k*6)*fiducialSpacing/15);
+            nDistances.push_back((84-k*6)*fiducialSpacing/15);
+        }
+        else
+        {
+            mDistances.push_back((45 + (k-7)*6)*fiducialSpacing/15);
+            nDistances.push_back((45 + (k-7)*6)*fiducialSpacing/15);
+        }
+    }
+
+    //For every bin of pair distance, a bitmask of the distances d whose
+    //tolerance band overlaps the bin. A pair then only has to be checked
+    //against the one or two d's its bin lists.
+    int bins = (std::max(mDistances[0], nDistances[0]) + tol)/ID_TABLE_STEP + 2;
+    mDistanceTable.assign(bins, 0);
+    nDistanceTable.assign(bins, 0);
+    for (int b = 0; b < bins; b++)
     {
-        //Get safe ranges for for the neighborhood around the fiducial
-        rowRange = SafeRange(round(pixelFiducials[k].y) - fiducialWidth,
-                             round(pixelFiducials[k].y) + fiducialWidth + 1,
-                             correlation.rows);
+        float low = b*ID_TABLE_STEP, high = (b+1)*ID_TABLE_STEP;
+        for (unsigned int d = 0; d < mDistances.size(); d++)
+        {
+            if (low < mDistances[d] + tol && high > mDistances[d] - tol)
+                mDistanceTable[b] |= 1u << d;
+            if (low < nDistances[d] + tol && high > nDistances[d] - tol)
+                nDistanceTable[b] |= 1u << d;
+        }
+    }
+    idTableStale = false;
+}
+
+//Bin of a fiducial ID vote
+static inline int VoteBin(int vote)
+{
+    if (vote >= -9 && vote <= 9) return vote + 9;
+    else return 19 + (vote + 201);
+}
 
-        colRange = SafeRange(round(pixelFiducials[k].x) - fiducialWidth,
-                             round(pixelFiducials[k].x) + fiducialWidth + 1,
-                             correlation.cols);
+static inline int BinVote(int bin)
+{
+    if (bin < 19) return bin - 9;
+    else return bin - 19 - 201;
+}
 
-        //Compute the centroid of the region around the local max
-        //in the correlation image
-        Cm = 0.0; Cn = 0.0; average = 0.0;
-        threshold = mean[0] + (fiducialThreshold/2)*stddev[0];
-        for (int m = rowRange.start; m < rowRange.end; m++)
+//The single most common vote, ID_VOTE_NONE if there were no votes, or
+//-200 if several votes tie for most common
+static int VoteMode(const unsigned short *counts)
+{
+    int best = 0, mode = ID_VOTE_NONE;
+    for (int b = 0; b < ID_VOTE_BINS; b++)
+    {
+        if (counts[b] > best)
         {
-            for (int n = colRange.start; n < colRange.end; n++)
-            {
-                thisValue = correlation.at<float>(m,n);
-                if (thisValue > threshold)
-                {
-                    Cm += ((float) m)*thisValue;
-                    Cn += ((float) n)*thisValue;
-                    average += thisValue;
-                }
-            }
+            best = counts[b];
+            mode = BinVote(b);
         }
+        else if (counts[b] == best && best > 0)
+            mode = -200;
+    }
+    return mode;
+}
+
+void Aspect::CastVote(std::vector<unsigned short> &votes, int fiducial, int vote)
+{
+    //Partners only ever hand on IDs that fit in a bin
+    if ((vote < -9 || vote > 9) && (vote < -201 || vote > -199)) return;
+    votes[fiducial*ID_VOTE_BINS + VoteBin(vote)]++;
+}
+
+void Aspect::FindFiducialIDs()
+{
+    unsigned int k, K = pixelFiducials.size();
+    int carried = 0;
 
-        //Set the fiducials to the centroid location, plus an offset
-        //to convert from the solar subimage to the original frame
-        pixelFiducials[k].y = (float) (Cm/average + ((float) offset.y));
-        pixelFiducials[k].x = (float) (Cn/average + ((float) offset.x));
+    if (!carryIDs || idVoteAge >= idPersistence)
+    {
+        //Vote on everything, but a fiducial that loses its pair partner
+        //keeps the ID it had
+        if (carryIDs)
+            carried = CarryFiducialIDs();
+        VoteFiducialIDs();
+        for (k = 0; k < K && carried > 0; k++)
+        {
+            if (fiducialIDs[k].x == -100) fiducialIDs[k].x = carriedIDs[k].x;
+            if (fiducialIDs[k].y == -100) fiducialIDs[k].y = carriedIDs[k].y;
+        }
+        idVoteAge = 0;
+        return;
     }
 
-    for (int k = 0; k < pixelFiducials.size(); k++)
+    idVoteAge++;
+    carried = CarryFiducialIDs();
+    if (carried == (int) K)
     {
-        if(!std::isfinite(pixelFiducials[k].x) || !std::isfinite(pixelFiducials[k].y))
-            pixelFiducials.erase(pixelFiducials.begin() + k);
+        fiducialIDs = carriedIDs;
+        rowPairs.clear();
+        colPairs.clear();
+        return;
+    }
 
+    //Vote for the fiducials that didn't match one from the last frame
+    VoteFiducialIDs();
+    for (k = 0; k < K; k++)
+    {
+        if (carriedIDs[k].x != -100)
+            fiducialIDs[k] = carriedIDs[k];
     }
-    return;
 }
 
-void Aspect::FindFiducialIDs()
+//Fills carriedIDs with the ID of the nearest fiducial from the last clean
+//frame, for each fiducial close enough to be the same one (-100 if none).
+//Neighboring fiducials are at least fiducialSpacing apart, so a match
+//within a quarter of that is unambiguous. Returns the number of fiducials
+//that were matched.
+int Aspect::CarryFiducialIDs()
+{
+    unsigned int k, j, K = pixelFiducials.size();
+    float tolerance = fiducialSpacing/4, distance, best;
+    int nearest, carried = 0;
+
+    carriedIDs.assign(K, cv::Point(-100, -100));
+    for (k = 0; k < K; k++)
+    {
+        nearest = -1;
+        best = tolerance;
+        for (j = 0; j < lastFiducials.size() && j < lastIDs.size(); j++)
+        {
+            if (lastIDs[j].x < -10 || lastIDs[j].y < -10) continue;
+            distance = std::max(std::abs(pixelFiducials[k].x - lastFiducials[j].x),
+                                std::abs(pixelFiducials[k].y - lastFiducials[j].y));
+            if (distance < best)
+            {
+                best = distance;
+                nearest = j;
+            }
+        }
+        if (nearest >= 0)
+        {
+            carriedIDs[k] = lastIDs[nearest];
+            carried++;
+        }
+    }
+    return carried;
+}
+
+void Aspect::VoteFiducialIDs()
 {
-    unsigned int d, k, l, K;
+    unsigned int k, l, K;
+    int bin, mode;
+    unsigned int matches;
     float rowDiff, colDiff;
-    CoordList trash;
-    CoordList rotatedFiducials;
-    
+    float minX, minY, cellSize, reach;
+    int gridCols, gridRows, cellReach, cm, cn;
+
+    if (idTableStale)
+        BuildIDTable();
+
     K = pixelFiducials.size();
     rowPairs.clear();
     colPairs.clear();
     fiducialIDs.clear();
     fiducialIDs.resize(K);
-    
-    std::vector<std::vector<int> > rowVotes, colVotes;
-    rowVotes.resize(K); colVotes.resize(K);
-    
-    std::vector<int> modes;
+    if (K == 0) return;
+
+    rowVotes.assign(K*ID_VOTE_BINS, 0);
+    colVotes.assign(K*ID_VOTE_BINS, 0);
 
     rotate(fiducialTwist, pixelFiducials, rotatedFiducials);
 
     //Find fiducial pairs that are spaced correctly
+    //Partners are one fiducialSpacing apart in one axis and at most the
+    //largest pair distance apart in the other, so bucket the fiducials in a
+    //grid of that first size and only look along the row and column of
+    //cells through each fiducial
     //std::cout << "Aspect: Find valid fiducial pairs" << std::endl;
     //std::cout << "Aspect: Searching through " << K << " Fiducials" << std::endl;
+    cellSize = fiducialSpacing + fiducialSpacingTol;
+    reach = std::max(mDistances[0], nDistances[0]) + fiducialSpacingTol;
+    if (cellSize < 1) cellSize = 1;
+    cellReach = (int) (reach/cellSize) + 1;
+
+    //Non-finite positions can't pair with anything, so they are left out
+    //of the grid altogether
+    minX = minY = std::numeric_limits<float>::infinity();
+    for (k = 0; k < K; k++)
+    {
+        if (!std::isfinite(rotatedFiducials[k].x) || !std::isfinite(rotatedFiducials[k].y))
+            continue;
+        minX = std::min(minX, rotatedFiducials[k].x);
+        minY = std::min(minY, rotatedFiducials[k].y);
+    }
+    gridCols = gridRows = 1;
+    fiducialCell.resize(K);
+    for (k = 0; k < K; k++)
+    {
+        if (!std::isfinite(rotatedFiducials[k].x) || !std::isfinite(rotatedFiducials[k].y))
+        {
+            fiducialCell[k] = cv::Point(-1, -1);
+            continue;
+        }
+        cn = (rotatedFiducials[k].x - minX)/cellSize;
+        cm = (rotatedFiducials[k].y - minY)/cellSize;
+        fiducialCell[k] = cv::Point(cn, cm);
+        gridCols = std::max(gridCols, cn + 1);
+        gridRows = std::max(gridRows, cm + 1);
+    }
+    pairGridHead.assign(gridRows*gridCols, -1);
+    pairGridNext.resize(K);
+    for (k = K; k-- > 0; )
+    {
+        if (fiducialCell[k].x < 0) continue;
+        int cell = fiducialCell[k].y*gridCols + fiducialCell[k].x;
+        pairGridNext[k] = pairGridHead[cell];
+        pairGridHead[cell] = k;
+    }
+
     for (k = 0; k < K; k++)
     {
-        for (l = k+1; l < K; l++)
+        if (fiducialCell[k].x < 0) continue;
+        cn = fiducialCell[k].x;
+        cm = fiducialCell[k].y;
+
+        //The horizontal strip of cells, then the rest of the vertical one
+        partners.clear();
+        for (int i = std::max(cm - 1, 0); i <= std::min(cm + 1, gridRows - 1); i++)
+            for (int j = std::max(cn - cellReach, 0); j <= std::min(cn + cellReach, gridCols - 1); j++)
+                for (int p = pairGridHead[i*gridCols + j]; p >= 0; p = pairGridNext[p])
+                    if ((unsigned int) p > k) partners.push_back(p);
+        for (int i = std::max(cm - cellReach, 0); i <= std::min(cm + cellReach, gridRows - 1); i++)
         {
+            if (i >= cm - 1 && i <= cm + 1) continue;
+            for (int j = std::max(cn - 1, 0); j <= std::min(cn + 1, gridCols - 1); j++)
+                for (int p = pairGridHead[i*gridCols + j]; p >= 0; p = pairGridNext[p])
+                    if ((unsigned int) p > k) partners.push_back(p);
+        }
+        //Same pair order as checking every l > k
+        std::sort(partners.begin(), partners.end());
+
+        for (unsigned int p = 0; p < partners.size(); p++)
+        {
+            l = partners[p];
             rowDiff = rotatedFiducials[k].y - rotatedFiducials[l].y;
             colDiff = rotatedFiducials[k].x - rotatedFiducials[l].x;
 
@@ -1317,20 +3290,25 @@ void Aspect::FindFiducialIDs()
         rowDiff = rotatedFiducials[rowPairs[k].y].y 
             - rotatedFiducials[rowPairs[k].x].y;
 
-        for (d = 0; d < mDistances.size(); d++)
+        //Only the distances listed for this bin can be within tolerance
+        bin = fabs(rowDiff)/ID_TABLE_STEP;
+        matches = (bin < (int) mDistanceTable.size()) ? mDistanceTable[bin] : 0;
+        while (matches)
         {
+            int d = __builtin_ctz(matches);
+            matches &= matches - 1;
             if (fabs(fabs(rowDiff) - mDistances[d]) < fiducialSpacingTol)
             {
                 //std::cout << fabs(rowDiff) - mDistances[d] << " ";
                 if (rowDiff > 0) 
                 {
-                    rowVotes[rowPairs[k].x].push_back(d-7);
-                    rowVotes[rowPairs[k].y].push_back(d+1-7);
+                    CastVote(rowVotes, rowPairs[k].x, d-7);
+                    CastVote(rowVotes, rowPairs[k].y, d+1-7);
                 }
                 else
                 {
-                    rowVotes[rowPairs[k].x].push_back(d+1-7);
-                    rowVotes[rowPairs[k].y].push_back(d-7);
+                    CastVote(rowVotes, rowPairs[k].x, d+1-7);
+                    CastVote(rowVotes, rowPairs[k].y, d-7);
                 }
             }
         }
@@ -1342,20 +3320,25 @@ void Aspect::FindFiducialIDs()
     {
         colDiff = rotatedFiducials[colPairs[k].x].x 
             - rotatedFiducials[colPairs[k].y].x;
-        for (d = 0; d <  nDistances.size(); d++)
+
+        bin = fabs(colDiff)/ID_TABLE_STEP;
+        matches = (bin < (int) nDistanceTable.size()) ? nDistanceTable[bin] : 0;
+        while (matches)
         {
+            int d = __builtin_ctz(matches);
+            matches &= matches - 1;
             if (fabs(fabs(colDiff) - nDistances[d]) < fiducialSpacingTol)
             {
                 //std::cout << fabs(colDiff) - nDistances[d] << " ";
                 if (colDiff > 0) 
                 {
-                    colVotes[colPairs[k].x].push_back(d-7);
-                    colVotes[colPairs[k].y].push_back(d+1-7);
+                    CastVote(colVotes, colPairs[k].x, d-7);
+                    CastVote(colVotes, colPairs[k].y, d+1-7);
                 }
                 else
                 {
-                    colVotes[colPairs[k].x].push_back(d+1-7);
-                    colVotes[colPairs[k].y].push_back(d-7);
+                    CastVote(colVotes, colPairs[k].x, d+1-7);
+                    CastVote(colVotes, colPairs[k].y, d-7);
                 }
             }
         }
@@ -1365,38 +3348,16 @@ void Aspect::FindFiducialIDs()
     // Accumulate results of first pass
     for (k = 0; k < K; k++)
     {
-        modes = Mode(rowVotes[k]);
-        if (modes.size() > 1)
-        {
-            fiducialIDs[k].y = -200;
-        }
-        else if (modes.size() == 1)
-        {
-            fiducialIDs[k].y = modes[0];
-        }
-        else
-        {
-            fiducialIDs[k].y = -100;
-        }
+        mode = VoteMode(&rowVotes[k*ID_VOTE_BINS]);
+        fiducialIDs[k].y = (mode == ID_VOTE_NONE) ? -100 : mode;
 
-        modes = Mode(colVotes[k]);
-        if (modes.size() > 1)
-        {
-            fiducialIDs[k].x = -200;
-        }
-        else if (modes.size() == 1)
-        {
-            fiducialIDs[k].x = modes[0];
-        }
-        else
-        {
-            fiducialIDs[k].x = -100;
-        }
+        mode = VoteMode(&colVotes[k*ID_VOTE_BINS]);
+        fiducialIDs[k].x = (mode == ID_VOTE_NONE) ? -100 : mode;
     }
 
     // Start second pass
-    rowVotes.clear(); rowVotes.resize(K);
-    colVotes.clear(); colVotes.resize(K);
+    std::fill(rowVotes.begin(), rowVotes.end(), 0);
+    std::fill(colVotes.begin(), colVotes.end(), 0);
     //std::cout << "Aspect: Compute intra-pair distances for row pairs." << std::endl;
     for (k = 0; k <  rowPairs.size(); k++)
     {
@@ -1406,27 +3367,27 @@ void Aspect::FindFiducialIDs()
         //If part of a row pair has an unidentified column index, it should match its partner
         if (fiducialIDs[rowPairs[k].x].x == -100 && fiducialIDs[rowPairs[k].y].x != -100)
         {
-            colVotes[rowPairs[k].x].push_back(fiducialIDs[rowPairs[k].y].x);
+            CastVote(colVotes, rowPairs[k].x, fiducialIDs[rowPairs[k].y].x);
         }
         else if (fiducialIDs[rowPairs[k].x].x != -100 && fiducialIDs[rowPairs[k].y].x == -100)
         {
-            colVotes[rowPairs[k].y].push_back(fiducialIDs[rowPairs[k].x].x);
+            CastVote(colVotes, rowPairs[k].y, fiducialIDs[rowPairs[k].x].x);
         }
     
         //If part of a row pair has an unidentified row index, it should be incremented from its partner
         if (fiducialIDs[rowPairs[k].x].y == -100 && fiducialIDs[rowPairs[k].y].y != -100)
         {
             if (rowDiff >= 0)
-                rowVotes[rowPairs[k].x].push_back(fiducialIDs[rowPairs[k].y].y - 1);
+                CastVote(rowVotes, rowPairs[k].x, fiducialIDs[rowPairs[k].y].y - 1);
             else 
-                rowVotes[rowPairs[k].x].push_back(fiducialIDs[rowPairs[k].y].y + 1);
+                CastVote(rowVotes, rowPairs[k].x, fiducialIDs[rowPairs[k].y].y + 1);
         }
         else if (fiducialIDs[rowPairs[k].x].y != -100 && fiducialIDs[rowPairs[k].y].y == -100)
         {
             if (rowDiff >= 0)
-                rowVotes[rowPairs[k].y].push_back(fiducialIDs[rowPairs[k].x].y + 1);
+                CastVote(rowVotes, rowPairs[k].y, fiducialIDs[rowPairs[k].x].y + 1);
             else 
-                rowVotes[rowPairs[k].y].push_back(fiducialIDs[rowPairs[k].x].y - 1);
+                CastVote(rowVotes, rowPairs[k].y, fiducialIDs[rowPairs[k].x].y - 1);
         }
     }
 
@@ -1438,85 +3399,72 @@ void Aspect::FindFiducialIDs()
         //For columns, pairs should match in row
         if (fiducialIDs[colPairs[k].x].y == -100 && fiducialIDs[colPairs[k].y].y != -100)
         {
-            rowVotes[colPairs[k].x].push_back(fiducialIDs[colPairs[k].y].y);
+            CastVote(rowVotes, colPairs[k].x, fiducialIDs[colPairs[k].y].y);
         }
         else if (fiducialIDs[colPairs[k].x].y != -100 && fiducialIDs[colPairs[k].y].y == -100)
         {
-            rowVotes[colPairs[k].y].push_back(fiducialIDs[colPairs[k].x].y);
+            CastVote(rowVotes, colPairs[k].y, fiducialIDs[colPairs[k].x].y);
         }
 
         //For columns, pairs should increment in column.
         if (fiducialIDs[colPairs[k].x].x == -100 && fiducialIDs[colPairs[k].y].x != -100)
         {
             if (colDiff >= 0)
-                colVotes[colPairs[k].x].push_back(fiducialIDs[colPairs[k].y].x - 1);
+                CastVote(colVotes, colPairs[k].x, fiducialIDs[colPairs[k].y].x - 1);
             else 
-                colVotes[colPairs[k].x].push_back(fiducialIDs[colPairs[k].y].x + 1);
+                CastVote(colVotes, colPairs[k].x, fiducialIDs[colPairs[k].y].x + 1);
         }
         else if (fiducialIDs[colPairs[k].x].x != -100 && fiducialIDs[colPairs[k].y].x == -100)
         {
             if (colDiff >= 0)
-                colVotes[colPairs[k].y].push_back(fiducialIDs[colPairs[k].x].x + 1);
+                CastVote(colVotes, colPairs[k].y, fiducialIDs[colPairs[k].x].x + 1);
             else 
-                colVotes[colPairs[k].y].push_back(fiducialIDs[colPairs[k].x].x - 1);
+                CastVote(colVotes, colPairs[k].y, fiducialIDs[colPairs[k].x].x - 1);
         }
     }
     
     //Vote on second pass
     for (k = 0; k < K; k++)
     {
-        modes = Mode(rowVotes[k]);
-        if (modes.size() > 1)
-        {
-            fiducialIDs[k].y = -200;
-        }
-        else if (modes.size() == 1)
-        {
-            fiducialIDs[k].y = modes[0];
-        }
+        mode = VoteMode(&rowVotes[k*ID_VOTE_BINS]);
+        if (mode != ID_VOTE_NONE)
+            fiducialIDs[k].y = mode;
 
-        modes = Mode(colVotes[k]);
-        if (modes.size() > 1)
-        {
-            fiducialIDs[k].x = -200;
-        }
-        else if (modes.size() == 1)
-        {
-            fiducialIDs[k].x = modes[0];
-        }
+        mode = VoteMode(&colVotes[k*ID_VOTE_BINS]);
+        if (mode != ID_VOTE_NONE)
+            fiducialIDs[k].x = mode;
     }
 }       
 
 void Aspect::FindMapping()
 {
-    std::vector<float> x, y, fit;
+    LineAccumulator sums;
     cv::Point2f screenPoint;
+    float intercept, slope, cond;
     mapping.clear();
     mapping.resize(4);
 
     for (int dim = 0; dim < 2; dim++)
     {
-        x.clear();
-        y.clear();
+        sums.Reset();
         for (unsigned int k = 0; k <  pixelFiducials.size(); k++)
         {
             if(fiducialIDs[k].x < -10 || fiducialIDs[k].y < -10) continue;
             
             screenPoint = fiducialIDtoScreen(fiducialIDs[k]);         
             if(dim == 0)
-            {
-                x.push_back(pixelFiducials[k].x);
-                y.push_back(screenPoint.x);
-            }
+                sums.Add(pixelFiducials[k].x, screenPoint.x);
             else
-            {
-                x.push_back(pixelFiducials[k].y);
-                y.push_back(screenPoint.y);
-            }
+                sums.Add(pixelFiducials[k].y, screenPoint.y);
+        }
+        if (!sums.Solve(intercept, slope, &cond))
+        {
+            intercept = slope = std::numeric_limits<float>::quiet_NaN();
+            cond = std::numeric_limits<float>::infinity();
         }
-        LinearFit(x,y,fit);
-        mapping[2*dim + 0] = fit[0];
-        mapping[2*dim + 1] = fit[1];
+        mapping[2*dim + 0] = intercept;
+        mapping[2*dim + 1] = slope;
+        conditionNumbers[dim] = cond;
     }
 }
 
@@ -1547,10 +3495,7 @@ cv::Range SafeRange(int start, int stop, int size)
 
 void LinearFit(const std::vector<float> &x, const std::vector<float> &y, std::vector<float> &fit)
 {
-    cv::Scalar init(0);
-    cv::Mat A(2,2,CV_32FC1, init), B(2,1,CV_32FC1, init), X(2,1,CV_32FC1, init);
-    cv::Mat eigenvalues;
-    float N, cond;
+    LineAccumulator sums;
     unsigned int l;
 
     if (x.size() != y.size())
@@ -1559,29 +3504,14 @@ void LinearFit(const std::vector<float> &x, const std::vector<float> &y, std::ve
         return;
     }
 
-    N = (float) x.size();
-    A.at<float>(1,1) = N;
-
     for (l = 0; l <  x.size(); l++)
-    {
-        A.at<float>(0,0) += x[l]*x[l];
-        A.at<float>(0,1) += x[l];
-        B.at<float>(1) += y[l];
-        B.at<float>(0) += x[l]*y[l];
-    }
-
-    A.at<float>(1,0) = A.at<float>(0,1);
-    
-    cv::eigen(A, eigenvalues);
-    cond = eigenvalues.at<float>(0)/eigenvalues.at<float>(1);
-    //std::cout << "Condition number: " << cond << std::endl;
+        sums.Add(x[l], y[l]);
 
-    cv::solve(A,B,X,cv::DECOMP_CHOLESKY);
-    
     fit.clear();
     fit.resize(2);
-    fit[0] = X.at<float>(1); //intercept
-    fit[1] = X.at<float>(0); //slope
+    //A degenerate fit gives NaNs, which callers already screen for
+    if (!sums.Solve(fit[0], fit[1]))
+        fit[0] = fit[1] = std::numeric_limits<float>::quiet_NaN();
 }
 
 void CircleFit(const std::vector<float> &x, const std::vector<float> &y, Circle& fit)
@@ -1599,66 +3529,151 @@ void CircleFit(const std::vector<float> &x, const std::vector<float> &y, Circle&
 
 void CircleFit(const CoordList& points, Circle& fit)
 {
-    cv::Mat B, D, Y;
-    float x, y;
-
-    cv::Point2f center;
-    float radius, MSE;
-    std::vector<float> residual, CookDistance;
-    CoordList CookPoints;
-    cv::Mat H;
-
-    B = cv::Mat(points.size(), 3, CV_32F);
-    D = cv::Mat(points.size(), 1, CV_32F);
-    Y = cv::Mat(3,1, CV_32F);
-    H = cv::Mat(points.size(), points.size(), CV_32F);
-    CookDistance = cv::Mat(points.size(), 1, CV_32F);
+    CircleAccumulator sums;
 
+    sums.Reset(Mean(points));
     for (unsigned int k = 0; k < points.size(); k++)
-    {
-        x = points[k].x;
-        y = points[k].y;
-        B.at<float>(k,0) = x;
-        B.at<float>(k,1) = y;
-        B.at<float>(k,2) = 1;
-        D.at<float>(k) = pow(x,2) + pow(y,2);
-    }
-    
-    cv::solve((B.t()*B), (B.t()*D), Y, cv::DECOMP_CHOLESKY);
-    center.x = Y.at<float>(0)/2;
-    center.y = Y.at<float>(1)/2;
-    radius = sqrt(Y.at<float>(2) + pow(center.x,2) + pow(center.y,2));
+        sums.Add(points[k]);
+    RejectOutliers(sums, points, fit);
+}
 
-    H = B*((B.t()*B).inv())*B.t();
+bool RejectOutliers(CircleAccumulator &sums, const CoordList &points, Circle &fit)
+{
+    int N = sums.Count();
+    int removed = 0;
+    CircleAccumulator trimmed;
+    Circle refit;
+
+    if (!sums.Solve(fit)) return false;
+    if (N <= 4) return true;
+
+    //Every Cook's distance is against the fit to all the points. The
+    //usual cutoff is 4/N. The outliers come out of a copy, so that if the
+    //refit fails sums still holds the fit to all the points.
+    trimmed = sums;
     for (unsigned int k = 0; k < points.size(); k++)
     {
-        residual.push_back(pow(Euclidian(points[k] - center),2));
-        CookDistance[k] = residual[k] * H.at<float>(k,k) / 
-            pow(1 - H.at<float>(k,k), 2);
-    }
-    MSE = Mean(residual); 
-    CookPoints = points;
-    for (unsigned int k = 0; k < CookPoints.size(); k++)
-    {
-        if (CookDistance[k] > MSE)
+        if (sums.CookDistance(points[k]) > 4.0/N)
         {
-            CookDistance.erase(CookDistance.begin() + k);
-            CookPoints.erase(CookPoints.begin() + k);
-            k--;
+            trimmed.Remove(points[k]);
+            removed++;
         }
     }
 
-    if (CookPoints.size() < points.size() && CookPoints.size() > 4)
+    if (removed > 0 && trimmed.Count() > 4 && trimmed.Solve(refit))
     {
-        std::cout << "Go again with " << CookPoints.size() << " points" << std::endl;
-        CircleFit(CookPoints, fit);
+        sums = trimmed;
+        fit = refit;
     }
+    return true;
+}
 
-    fit[0] = center.x;
-    fit[1] = center.y;
-    fit[2] = radius;
+CircleAccumulator::CircleAccumulator()
+{
+    Reset();
+}
 
-    return;
+void CircleAccumulator::Reset(cv::Point2f newOrigin)
+{
+    origin = newOrigin;
+    n = sx = sy = sxx = sxy = syy = sz = sxz = syz = szz = 0;
+    variance = 0;
+    memset(inverse, 0, sizeof(inverse));
+    memset(solution, 0, sizeof(solution));
+}
+
+void CircleAccumulator::Add(cv::Point2f point)
+{
+    Accumulate(point, 1);
+}
+
+void CircleAccumulator::Remove(cv::Point2f point)
+{
+    Accumulate(point, -1);
+}
+
+void CircleAccumulator::Accumulate(cv::Point2f point, double weight)
+{
+    //Work relative to the origin so the sums don't lose precision
+    double x = point.x - origin.x, y = point.y - origin.y;
+    double z = x*x + y*y;
+    n += weight;
+    sx += weight*x;
+    sy += weight*y;
+    sxx += weight*x*x;
+    sxy += weight*x*y;
+    syy += weight*y*y;
+    sz += weight*z;
+    sxz += weight*x*z;
+    syz += weight*y*z;
+    szz += weight*z*z;
+}
+
+int CircleAccumulator::Count()
+{
+    return (int) (n + 0.5);
+}
+
+bool CircleAccumulator::Solve(Circle &fit)
+{
+    //Kasa fit: x^2 + y^2 = a*x + b*y + c in the least squares sense, so
+    //the normal equations are M*[a b c]' = [sxz syz sz]'
+    double M[3][3] = {{sxx, sxy, sx}, {sxy, syy, sy}, {sx, sy, n}};
+    double v[3] = {sxz, syz, sz};
+    double newInverse[3][3], newSolution[3];
+    double sse, cx, cy, r2;
+
+    if (n < 3) return false;
+
+    //Collinear points, or too few distinct ones, are singular
+    if (!Invert3x3(M, newInverse))
+        return false;
+
+    for (int i = 0; i < 3; i++)
+        newSolution[i] = newInverse[i][0]*v[0] + newInverse[i][1]*v[1] + newInverse[i][2]*v[2];
+
+    cx = newSolution[0]/2;
+    cy = newSolution[1]/2;
+    r2 = newSolution[2] + cx*cx + cy*cy;
+    if (r2 <= 0) return false;
+
+    //Sum of squared residuals, also straight from the sums
+    sse = szz - 2*(newSolution[0]*sxz + newSolution[1]*syz + newSolution[2]*sz);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            sse += newSolution[i]*M[i][j]*newSolution[j];
+
+    //Only a successful fit replaces the one CookDistance and CenterError use
+    memcpy(inverse, newInverse, sizeof(inverse));
+    memcpy(solution, newSolution, sizeof(solution));
+    variance = (n > 3 && sse > 0) ? sse/(n - 3) : 0;
+
+    fit[0] = cx + origin.x;
+    fit[1] = cy + origin.y;
+    fit[2] = std::sqrt(r2);
+    return true;
+}
+
+float CircleAccumulator::CookDistance(cv::Point2f point)
+{
+    double x = point.x - origin.x, y = point.y - origin.y;
+    double b[3] = {x, y, 1};
+    double residual = x*x + y*y - (solution[0]*x + solution[1]*y + solution[2]);
+    double leverage = 0;
+
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            leverage += b[i]*inverse[i][j]*b[j];
+
+    if (variance <= 0 || leverage >= 1) return 0;
+    return residual*residual*leverage/(3*variance*(1 - leverage)*(1 - leverage));
+}
+
+cv::Point2f CircleAccumulator::CenterError()
+{
+    //The center is half of (a, b)
+    return cv::Point2f(std::sqrt(variance*inverse[0][0])/2,
+                       std::sqrt(variance*inverse[1][1])/2);
 }
 
 cv::Point2f VectorToCircle(Circle circle, cv::Point2f point)
@@ -1763,32 +3778,111 @@ void rotate(float angle, const CoordList &inPoints, CoordList &outPoints)
 
 void calcMinMax(cv::Mat frame, unsigned char& min, unsigned char& max)
 {
-    cv::Mat hist;
-    int size[] = {256};
-    float range[] = {0, 256};
-    const float *ranges[] = {range};
+    calcMinMax(frame, min, max, 0);
+}
+
+void calcMinMax(cv::Mat frame, unsigned char& min, unsigned char& max, float tolerance)
+{
+    unsigned int counts[256];
+    double hist[256];
+    long len = frame.rows*frame.cols;
+    int sampleStep = MinMaxSampleStep(len, tolerance);
+
+    memset(counts, 0, sizeof(counts));
+    AccumulateHistogram(frame.ptr<unsigned char>(0), frame.rows, frame.cols, frame.step,
+                        sampleStep, sampleStep, counts);
+
+    //With every pixel counted this is exactly the full histogram. Otherwise
+    //scale the samples up to the size of the frame.
+    long samples = (long) ((frame.rows + sampleStep - 1)/sampleStep)*((frame.cols + sampleStep - 1)/sampleStep);
+    double weight = (sampleStep == 1 || samples == 0) ? 1 : (double) len/samples;
+    for (int j = 0; j < 256; j++)
+        hist[j] = weight*counts[j];
+    histMinMax(hist, len, min, max);
+}
+
+void calcMinMax(cv::Mat frame, int& min, int& max, float tolerance)
+{
+    unsigned int counts[256], lowCounts[256], highCounts[256];
+    double hist[256];
+    unsigned char lowBucket, highBucket, min8, max8;
+    double total, lowTarget, highTarget;
+    int j;
 
-    cv::calcHist(&frame, 1, //just one matrix
-                 {0},       //just the first channel
-                 cv::Mat(), //no mask
-                 hist,      //output histogram
-                 1, size,   //number of dimensions and bins
-                 ranges,  //range of histogram
-                 true,      //uniform?
-                 false);    //accumulate?
+    if (frame.depth() != CV_16U)
+    {
+        calcMinMax(frame, min8, max8, tolerance);
+        min = min8;
+        max = max8;
+        return;
+    }
 
     long len = frame.rows*frame.cols;
-    long total = 0;
+    int sampleStep = MinMaxSampleStep(len, tolerance);
+    long samples = (long) ((frame.rows + sampleStep - 1)/sampleStep)*((frame.cols + sampleStep - 1)/sampleStep);
+    double weight = (sampleStep == 1 || samples == 0) ? 1 : (double) len/samples;
+    const unsigned short *pixels = frame.ptr<unsigned short>(0);
+
+    //High bytes first, with the same percentiles as histMinMax
+    memset(counts, 0, sizeof(counts));
+    AccumulateHistogram(pixels, frame.rows, frame.cols, frame.step,
+                        sampleStep, sampleStep, counts);
+    for (j = 0; j < 256; j++)
+        hist[j] = weight*counts[j];
+    histMinMax(hist, len, lowBucket, highBucket);
+
+    //Then the low bytes of just those two buckets
+    memset(lowCounts, 0, sizeof(lowCounts));
+    memset(highCounts, 0, sizeof(highCounts));
+    AccumulateBucketHistograms(pixels, frame.rows, frame.cols, frame.step,
+                               sampleStep, sampleStep,
+                               lowBucket, lowCounts, highBucket, highCounts);
+    if (highBucket == lowBucket)
+        memcpy(highCounts, lowCounts, sizeof(highCounts));
+
+    lowTarget = 0.005*len;
+    highTarget = std::floor(0.995*len);
+    total = 0;
+    for (j = 0; j < lowBucket; j++)
+        total += hist[j];
+    min = (lowBucket << 8) + 255;
+    for (j = 0; j < 256; j++)
+    {
+        total += weight*lowCounts[j];
+        if (total >= lowTarget)
+        {
+            min = (lowBucket << 8) + j;
+            break;
+        }
+    }
+    total = 0;
+    for (j = 0; j < highBucket; j++)
+        total += hist[j];
+    max = (highBucket << 8) + 255;
+    for (j = 0; j < 256; j++)
+    {
+        total += weight*highCounts[j];
+        if (total >= highTarget)
+        {
+            max = (highBucket << 8) + j;
+            break;
+        }
+    }
+}
+
+void histMinMax(const double *hist, double len, unsigned char& min, unsigned char& max)
+{
+    double total = 0;
     bool min_found = false, max_found = false;
-    uint8_t j = 0;
+    int j = 0;
     min = 255; max = 0;
-    while((j < hist.rows) && (!min_found || !max_found)) {
-        total += *hist.ptr<float>(j);
+    while((j < 256) && (!min_found || !max_found)) {
+        total += hist[j];
         if (!min_found && (total >= 0.005*len)) {
             min = j;
             min_found = true;
         }
-        if (!max_found && (total >= (long)(0.995*len))) {
+        if (!max_found && (total >= std::floor(0.995*len))) {
             max = j;
             max_found = true;
         }
@@ -1801,3 +3895,41 @@ void calcMinMax(cv::Mat frame, unsigned char& min, unsigned char& max)
     }
 }
 
+unsigned int ValidProducts(AspectCode code)
+{
+    unsigned int valid = 0;
+    switch(GeneralizeError(code))
+    {
+    case NO_ERROR:
+        valid |= PRODUCT_MAPPING;
+    case MAPPING_ERROR:
+        valid |= PRODUCT_IDS;
+    case ID_ERROR:
+        valid |= PRODUCT_FIDUCIALS;
+    case FIDUCIAL_ERROR:
+        valid |= PRODUCT_CENTER;
+    case CENTER_ERROR:
+        valid |= PRODUCT_LIMBS;
+    case LIMB_ERROR:
+    case RANGE_ERROR:
+        valid |= PRODUCT_MINMAX;
+        break;
+    default:
+        break;
+    }
+    return valid;
+}
+
+int MinMaxSampleStep(long pixels, float tolerance)
+{
+    if (tolerance <= 0 || pixels <= 0) return 1;
+
+    //The rank of a percentile estimated from n samples is off by about
+    //sqrt(p*(1-p)/n) of the pixels. Take enough samples that twice that
+    //stays under the tolerance at p = 0.5%, on a square grid.
+    double needed = 4*0.005*0.995/(tolerance*tolerance);
+    double stride = pixels/needed;
+    int step = (int) std::sqrt(stride);
+    return (step > 1) ? step : 1;
+}
+
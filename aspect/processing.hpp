@@ -1,9 +1,13 @@
 #include <opencv.hpp>
 #include <vector>
 #include <list>
+#include <string>
 #include <cstring>
+#include <ctime>
 #include "AspectError.hpp"
 #include "AspectParameter.hpp"
+#include "WorkerPool.hpp"
+#include "CheckpointWriter.hpp"
 
 class CoordList : public std::vector<cv::Point2f>
 {
@@ -29,6 +33,32 @@ public:
     float r() {return cv::Vec3f::operator[](2); }
 };
 
+//Least squares (Kasa) circle fit whose normal equations are accumulated
+//one point at a time, so points can be added, or removed again, in O(1)
+//and the fit is a closed form 3x3 solve.
+class CircleAccumulator
+{
+public:
+    CircleAccumulator();
+    void Reset(cv::Point2f origin = cv::Point2f(0,0));
+    void Add(cv::Point2f point);
+    void Remove(cv::Point2f point);
+    int Count();
+
+    //Returns false if the points don't determine a circle
+    bool Solve(Circle &fit);
+    //These refer to the last successful Solve
+    float CookDistance(cv::Point2f point);
+    cv::Point2f CenterError();
+
+private:
+    void Accumulate(cv::Point2f point, double weight);
+
+    cv::Point2f origin;
+    double n, sx, sy, sxx, sxy, syy, sz, sxz, syz, szz;
+    double inverse[3][3], solution[3], variance;
+};
+
 class CircleList : public std::vector<Circle>
 {
 public:
@@ -36,17 +66,92 @@ public:
     void add(cv::Point2f c, float r) {this->push_back(Circle(c.x, c.y, r)); }
 };
 
+//Capacities of the arrays in AspectResult. Anything beyond them is left
+//out of the result, but is still available from the Get functions.
+#define RESULT_MAX_LIMBS 128
+#define RESULT_MAX_FIDUCIALS 64
+
+//Bits of AspectResult::valid
+enum AspectProduct
+{
+    PRODUCT_MINMAX = 1,
+    PRODUCT_LIMBS = 2,
+    PRODUCT_CENTER = 4,
+    PRODUCT_FIDUCIALS = 8,
+    PRODUCT_IDS = 16,
+    PRODUCT_MAPPING = 32
+};
+
+//What the fast-reject gate made of a frame
+enum GateDecision
+{
+    GATE_PASSED = 0,
+    GATE_NO_SUN,
+    GATE_SATURATED,
+    GATE_LOW_CONTRAST,
+    NUM_GATE_DECISIONS
+};
+
+//Stages of a Run, for timing
+enum AspectStage
+{
+    STAGE_MINMAX = 0,
+    STAGE_CENTER,
+    STAGE_FIDUCIALS,
+    STAGE_IDS,
+    STAGE_MAPPING,
+    NUM_STAGES
+};
+
+//Every data product of a Run, in fixed-size storage so that it can be
+//copied or handed to another thread without allocating. Only the products
+//flagged in valid are from this frame.
+struct AspectResult
+{
+    AspectCode runResult;
+    unsigned int valid;
+
+    int frameMin, frameMax;
+
+    int limbCount;
+    cv::Point2f limbCrossings[RESULT_MAX_LIMBS];
+
+    cv::Point2f pixelCenter, pixelError;
+
+    //fiducialIDs and screenFiducials line up with pixelFiducials
+    int fiducialCount;
+    cv::Point2f pixelFiducials[RESULT_MAX_FIDUCIALS];
+    cv::Point fiducialIDs[RESULT_MAX_FIDUCIALS];
+    cv::Point2f screenFiducials[RESULT_MAX_FIDUCIALS];
+
+    float mapping[4];
+    cv::Point2f screenCenter;
+
+    //Milliseconds spent in each stage (0 for stages that didn't run)
+    float stageTimes[NUM_STAGES];
+};
+
 class Aspect
 {
 public:
-    Aspect();
+    //With a checkpoint file, the tracking state and parameters saved there
+    //by an earlier Aspect (see CHECKPOINT_INTERVAL) are loaded, so that the
+    //first frame can be tracked instead of searched. Only parameters set
+    //away from their defaults are saved: to return one to its default, set
+    //it back to the default, or delete the file to start cold.
+    Aspect(const char *checkpoint = NULL);
     ~Aspect();
 
     AspectCode LoadFrame(cv::Mat inputFrame);
+    //Frames loaded with their capture time (CLOCK_MONOTONIC) let the sun
+    //center predictor account for the actual time between frames
+    AspectCode LoadFrame(cv::Mat inputFrame, timespec captureTime);
     AspectCode Run();
+    void ResetTracking();
     AspectCode FiducialRun();
 
     AspectCode GetPixelMinMax(unsigned char& min, unsigned char& max);
+    AspectCode GetPixelMinMax(int& min, int& max);
     AspectCode GetPixelCrossings(CoordList& crossings);
     AspectCode GetPixelCenter(cv::Point2f& center);
     AspectCode GetPixelError(cv::Point2f& error);
@@ -56,7 +161,10 @@ public:
     AspectCode GetMapping(std::vector<float>& map);
     AspectCode GetScreenCenter(cv::Point2f& center);
     AspectCode GetScreenFiducials(CoordList& fiducials);
-    
+
+    //All of the above from the last Run or FiducialRun. The reference stays
+    //valid, but its contents change on the next Run.
+    const AspectResult& GetResult();
 
 
     float GetFloat(AspectFloat variable);
@@ -66,8 +174,93 @@ public:
 
     AspectCode ReportFocus();
 
+    //Relative error of the factored fiducial kernel used in
+    //CORRELATION_SEPARABLE mode, as of the last Run
+    float GetKernelError();
+
+    //Milliseconds the last Run spent in a stage
+    float GetStageTime(AspectStage stage);
+    //Milliseconds the last Run spent refining fiducial peaks to sub-pixel,
+    //part of STAGE_FIDUCIALS (0 when the fiducials were tracked)
+    float GetRefineTime();
+
+    //Number of Runs the fast-reject gate has given each decision, since
+    //construction or the last ResetGateCounts
+    unsigned long GetGateCount(GateDecision decision);
+    void ResetGateCounts();
+
+private:
+    //Owns its worker pool, so can't be copied
+    Aspect(const Aspect &);
+    Aspect &operator=(const Aspect &);
+
 private:
     AspectCode state;
+    AspectResult result;
+
+    AspectCode ProcessFrame();
+    AspectCode ProcessFiducials();
+    void FillResult();
+
+    //Workers for splitting stages, NULL when running single threaded
+    int numThreads, poolSize;
+    WorkerPool *pool;
+    void UpdatePool();
+    void RunTasks(WorkerPool::Task task, int count);
+
+    //Per-chord results of FindLimbCrossings, filled in parallel
+    struct ChordResult
+    {
+        int error;
+        std::vector<float> crossings, slopes;
+    };
+    std::vector<ChordResult> chordResults;
+    cv::Mat chordInput;
+    const void *chordRows, *chordCols;
+    int chordColCount;
+    template <typename Pixel> void ScanChords(const cv::Mat &input, const std::vector<int> &rows,
+                                              const std::vector<int> &cols);
+    template <typename Pixel> static void ChordTask(void *arg, int index);
+
+    //Bands of the correlation, filled in parallel
+    const cv::Mat *bandImage;
+    cv::Mat *bandOutput;
+    int bandCount;
+    void CorrelateBands(const cv::Mat &image, cv::Mat &correlation, bool masked);
+    static void CorrelateTask(void *arg, int band);
+
+    //Row spans of the correlation image near the disk: row m covers columns
+    //[start[m], stop[m]). The correlation spans reach a pixel further out
+    //than the search spans so every searched peak has valid neighbors.
+    int diskMask;
+    bool bandMasked;
+    std::vector<int> corrSpanStart, corrSpanStop;
+    std::vector<int> searchSpanStart, searchSpanStop;
+    void BuildDiskSpans(int rows, int cols, cv::Point2f center, float radius,
+                        std::vector<int> &start, std::vector<int> &stop);
+
+    //Fixed tiles of correlation rows, for the statistics and peak search
+    //of a full search, filled in parallel
+    const cv::Mat *tileCorrelation;
+    float tileThreshold;
+    const int *tileSpanStart, *tileSpanStop;
+    std::vector<double> tileSums, tileSquares;
+    std::vector<std::vector<cv::Point> > tilePeaks;
+    static void TileStatsTask(void *arg, int tile);
+    static void TilePeaksTask(void *arg, int tile);
+
+    float timeBudget;
+    timespec runStart, stageStart;
+    float stageTimes[NUM_STAGES], stageEstimates[NUM_STAGES];
+    float refineTime;
+    void StartStages();
+    void EndStage(AspectStage stage);
+    bool StageFits(AspectStage stage);
+
+    int gateStride;
+    unsigned long gateCounts[NUM_GATE_DECISIONS];
+    std::vector<int> gateSamples;
+    AspectCode GateFrame();
 
     int initialNumChords;
     int chordsPerAxis;
@@ -75,16 +268,23 @@ private:
     float diskThreshold;
     int minLimbWidth;
     int limbFitWidth;
+    int centerMethod;
+    float momentTolerance;
+    int acquisitionLevels;
+    std::vector<cv::Mat> pyramid;
 
     float errorLimit;
 
     int solarRadius;
     float radiusMargin;
 
+    float predictorAlpha, predictorBeta;
+
     int fiducialLength;
     int fiducialWidth;
 
     int fiducialThreshold;
+    int fiducialRefine;
 
     int fiducialNeighborhood;
     int numFiducials;
@@ -92,37 +292,142 @@ private:
     float fiducialSpacing;
     float fiducialSpacingTol;
     float fiducialTwist;
+
+    int correlationMode;
+    int kernelRank;
+    float kernelError;
+
+    int fiducialTrackWindow;
     std::vector<float> mDistances, nDistances;
+    std::vector<unsigned int> mDistanceTable, nDistanceTable;
+    bool idTableStale;
+
+    float minMaxTolerance;
+    int minMaxROIRefresh;
     
+    void FindMinMax(int& min, int& max);
+    void PredictCenter();
+    void UpdatePredictor();
     void GenerateKernel();
-    int FindLimbCrossings(const cv::Mat &chord, std::vector<float> &crossings);
+    void BuildKernel(int length, int width, int edge, int d, cv::Mat &output);
+    void FactorKernel();
+    void Correlate(const cv::Mat &image, cv::Mat &correlation, bool masked = false);
+    void FindPeaks(const cv::Mat &correlation, float threshold,
+                   int rowStart, int rowStop, std::vector<cv::Point> &peaks,
+                   const int *spanStart = NULL, const int *spanStop = NULL);
+    void SelectFiducials(const cv::Mat &correlation, const std::vector<cv::Point> &peaks);
+    void MoveSlot(int slot, cv::Point position, float value, int gridCols, int cellSize);
+    bool SlotLess(int a, int b);
+    void SiftUp(int index);
+    void SiftDown(int index);
+    template <typename Pixel>
+    int FindLimbCrossings(const Pixel *chord, int K, std::vector<float> &crossings,
+                          std::vector<float> &edgeSlopes);
     void FindPixelCenter();
-    void FindPixelFiducials();
+    bool AcquireSun(cv::Range &rowRange, cv::Range &colRange);
+    bool FindMomentCenter(cv::Point2f around, cv::Point2f &centroid, bool &clipped);
+    void FindPixelFiducials(bool masked);
+    bool TrackPixelFiducials();
+    cv::Point2f RefinePeak(const cv::Mat &correlation, cv::Point peak, float threshold);
+    void RefinePeaks(const cv::Mat &correlation, float threshold);
+    void BuildIDTable();
+    void CastVote(std::vector<unsigned short> &votes, int fiducial, int vote);
     void FindFiducialIDs();
+    int CarryFiducialIDs();
+    void VoteFiducialIDs();
     void FindMapping();
     cv::Point2f PixelToScreen(cv::Point2f point);
 
     cv::Mat frame;
     cv::Size frameSize;
+    timespec frameTime;
+    bool frameTimed;
+
+    //Sun center predictor state, and its prediction for this frame
+    bool predictorValid, predictorTimed;
+    cv::Point2f predictorCenter, centerVelocity;
+    float predictorVariance;
+    timespec predictorTime;
+    bool usePrediction;
+    cv::Point2f predictedCenter;
+    float predictedSigma;
+    double predictionStep;
 
     cv::Mat solarImage;
     cv::Size solarImageSize;
     cv::Point2i solarImageOffset;
 
-    unsigned char frameMax, frameMin;
+    int frameMax, frameMin;
+
+    unsigned int roiHistogram[256];
+    cv::Size roiHistogramSize;
+    int roiHistogramAge;
 
     cv::Mat kernel;
+    bool kernelStale;
+    struct KernelCacheEntry
+    {
+        int length, width, edge, sharpness;
+        cv::Mat kernel;
+    };
+    std::vector<KernelCacheEntry> kernelCache;
+    std::vector<cv::Mat> kernelRowFactors, kernelColFactors;
+    std::vector<short> kernelQuantized;
+
+    std::vector<unsigned char> chordBuffer;
     
     CoordList limbCrossings;
+    CoordList fitCrossings;
+    CircleAccumulator limbFit;
 
     cv::Point2f pixelCenter;
     cv::Point2f pixelError;
     
     CoordList pixelFiducials;
 
+    //Peak selection buffers, kept between frames to avoid reallocating
+    std::vector<cv::Point> peakCandidates;
+    std::vector<int> gridHead, slotNext;
+    std::vector<cv::Point> slotPosition;
+    std::vector<float> slotValue;
+    std::vector<int> slotHeap, slotHeapIndex;
+    std::vector<int> peakRows, peakCols;
+    std::vector<float> peakOffsetX, peakOffsetY;
+
+    //Solution from the last clean Run, used to track fiducials
+    bool lastSolved, trackFiducials;
+    CoordList lastFiducials;
+    IndexList lastIDs;
+
+    //Carrying fiducial IDs forward from the last clean Run
+    int idPersistence;
+    int idVoteAge;
+    bool carryIDs;
+    IndexList carriedIDs;
+
+    //Saving the last clean Run to a checkpoint file, and warm-starting
+    //from one
+    std::string checkpointPath;
+    int checkpointInterval;
+    int checkpointAge;
+    bool warmStart;
+    cv::Size checkpointFrameSize;
+    int defaultInts[NUM_ASPECT_INTS];
+    float defaultFloats[NUM_ASPECT_FLOATS];
+    CheckpointWriter *checkpointWriter;
+    bool LoadCheckpoint();
+    void SaveCheckpoint();
+    float correlationMean, correlationStddev;
+
     IndexList rowPairs, colPairs;
     IndexList fiducialIDs;
 
+    //Fiducial ID buffers, kept between frames to avoid reallocating
+    CoordList rotatedFiducials;
+    std::vector<cv::Point> fiducialCell;
+    std::vector<int> pairGridHead, pairGridNext, partners;
+    std::vector<unsigned short> rowVotes, colVotes;
+
     std::vector<float> conditionNumbers;
     std::vector<float> mapping;
 
@@ -136,6 +441,10 @@ void LinearFit(const std::vector<float> &x, const std::vector<float> &y, std::ve
 void CircleFit(const std::vector<float> &x, const std::vector<float> &y, Circle &fit);
 void CircleFit(const CoordList &points, Circle &fit);
 
+//Solves the fit, drops the points with a large Cook's distance and solves
+//again. Returns false if there was no fit at all.
+bool RejectOutliers(CircleAccumulator &sums, const CoordList &points, Circle &fit);
+
 cv::Point2f VectorToCircle(Circle circle, cv::Point2f point);
 void VectorToCircle(Circle circle, CoordList points, CoordList vectors); 
 
@@ -154,4 +463,23 @@ void rotate(float angle, const CoordList &inPoints, CoordList &outPoints);
 //histogram (approximately the 0.5% on each end)
 void calcMinMax(cv::Mat frame, unsigned char& min, unsigned char& max);
 
+//Same, but only histograms a grid of samples from the frame, spaced so the
+//percentiles are within tolerance (a fraction of the pixels) of their true
+//rank. A tolerance of 0 histograms every pixel.
+void calcMinMax(cv::Mat frame, unsigned char& min, unsigned char& max, float tolerance);
+
+//Same for an 8 or 16-bit frame. 16-bit frames are done as a radix select:
+//a histogram of the high bytes finds the 256-value bucket each percentile
+//falls in, then a histogram of the low bytes in those buckets finds it.
+void calcMinMax(cv::Mat frame, int& min, int& max, float tolerance);
+
+//Finds the min/max percentiles from a 256-bin histogram summing to len
+void histMinMax(const double *hist, double len, unsigned char& min, unsigned char& max);
+
+//Grid spacing for sampling this many pixels to within tolerance
+int MinMaxSampleStep(long pixels, float tolerance);
+
+//The AspectProducts that are valid after a Run that returned code
+unsigned int ValidProducts(AspectCode code);
+
 cv::Point2f fiducialIDtoScreen(cv::Point2i id);
@@ -9,6 +9,10 @@
 #define SAVE_LOCATION1 "/mnt/disk1/"
 #define SAVE_LOCATION2 "/mnt/disk2/"
 
+//Aspect tracking state, so a restart can pick up the sun on its first frame
+#define ASPECT_CHECKPOINT "/mnt/disk1/aspect.checkpoint"
+#define ASPECT_CHECKPOINT_INTERVAL 20 // clean solutions between saves (~5 s)
+
 //Calibrated parameters
 #define CLOCKING_ANGLE_PYASF -32.425 //model is -33.26
 #define CENTER_X_PYASF    124.68 //mils
@@ -237,7 +241,7 @@ int sas_id;
 cv::Mat frame[2]; //protected by mutexHeader
 HeaderData header[2]; //protected by mutexHeader
 
-Aspect aspect;
+Aspect aspect(ASPECT_CHECKPOINT);
 Transform solarTransform(FORT_SUMNER, FLIGHT); //see Transform.hpp for options
 
 CameraSettings settings[2]; //not protected!
@@ -583,47 +587,18 @@ void image_process(int camera_id, cv::Mat &argFrame, HeaderData &argHeader)
 {
     AspectCode runResult;
 
-    CoordList localLimbs, localPixelFiducials, localScreenFiducials;
-    IndexList localIds;
     uint8_t localMin, localMax;
-    std::vector<float> localMapping;
-    cv::Point2f localPixelCenter, localScreenCenter, localError;
     Pair localOffset;
     
     if((camera_id == 0) && !argFrame.empty())
     {
-        aspect.LoadFrame(argFrame);
+        aspect.LoadFrame(argFrame, argHeader.captureTimeMono);
 
         argHeader.runResult = runResult = aspect.Run();
+        const AspectResult &result = aspect.GetResult();
 
-        switch(GeneralizeError(runResult))
-        {
-            case NO_ERROR:
-                aspect.GetScreenFiducials(localScreenFiducials);
-                aspect.GetScreenCenter(localScreenCenter);
-                aspect.GetMapping(localMapping);
-
-            case MAPPING_ERROR:
-                aspect.GetFiducialIDs(localIds);
-
-            case ID_ERROR:
-                aspect.GetPixelFiducials(localPixelFiducials);
-
-            case FIDUCIAL_ERROR:
-                aspect.GetPixelCenter(localPixelCenter);
-                aspect.GetPixelError(localError);
-
-            case CENTER_ERROR:
-                aspect.GetPixelCrossings(localLimbs);
-                if (REPORT_FOCUS) aspect.ReportFocus();
-
-            case LIMB_ERROR:
-            case RANGE_ERROR:
-                aspect.GetPixelMinMax(localMin, localMax);
-                break;
-            default:
-                std::cout << "Nothing worked\n";
-        }
+        if (result.valid == 0) std::cout << "Nothing worked\n";
+        if ((result.valid & PRODUCT_LIMBS) && REPORT_FOCUS) aspect.ReportFocus();
 
         //printf("Aspect result: %s\n", GetMessage(runResult));
 
@@ -640,30 +615,28 @@ void image_process(int camera_id, cv::Mat &argFrame, HeaderData &argHeader)
         switch(GeneralizeError(runResult))
         {
             case NO_ERROR:
-                solarTransform.set_conversion(Pair(localMapping[0],localMapping[2]),Pair(localMapping[1],localMapping[3]));
-                localOffset = solarTransform.calculateOffset(Pair(localPixelCenter.x,localPixelCenter.y), argHeader.captureTime);
+                solarTransform.set_conversion(Pair(result.mapping[0],result.mapping[2]),Pair(result.mapping[1],result.mapping[3]));
+                localOffset = solarTransform.calculateOffset(Pair(result.pixelCenter.x,result.pixelCenter.y), argHeader.captureTime);
                 argHeader.northAngle = solarTransform.getOrientation();
 
                 argHeader.CTLsolution[0] = localOffset.x();
                 argHeader.CTLsolution[1] = localOffset.y();
 
-                argHeader.screenCenter[0] = localScreenCenter.x;
-                argHeader.screenCenter[1] = localScreenCenter.y;
+                argHeader.screenCenter[0] = result.screenCenter.x;
+                argHeader.screenCenter[1] = result.screenCenter.y;
 
-                if(localMapping.size() == 4){
-                    argHeader.XYinterceptslope[0] = localMapping[0];
-                    argHeader.XYinterceptslope[1] = localMapping[2];
-                    argHeader.XYinterceptslope[2] = localMapping[1];
-                    argHeader.XYinterceptslope[3] = localMapping[3];
-                }
+                argHeader.XYinterceptslope[0] = result.mapping[0];
+                argHeader.XYinterceptslope[1] = result.mapping[2];
+                argHeader.XYinterceptslope[2] = result.mapping[1];
+                argHeader.XYinterceptslope[3] = result.mapping[3];
 
             case MAPPING_ERROR:
-                argHeader.fiducialCount = localIds.size();
+                argHeader.fiducialCount = result.fiducialCount;
                 for(uint8_t j = 0; j < 10; j++) {
                     if (j < argHeader.fiducialCount) {
                         uint8_t jp = (j+argHeader.frameCount) % argHeader.fiducialCount;
-                        argHeader.fiducialIDX[j] = localIds[jp].x;
-                        argHeader.fiducialIDY[j] = localIds[jp].y;
+                        argHeader.fiducialIDX[j] = result.fiducialIDs[jp].x;
+                        argHeader.fiducialIDY[j] = result.fiducialIDs[jp].y;
                     } else {
                         argHeader.fiducialIDX[j] = 0;
                         argHeader.fiducialIDY[j] = 0;
@@ -671,12 +644,12 @@ void image_process(int camera_id, cv::Mat &argFrame, HeaderData &argHeader)
                 }
 
             case ID_ERROR:
-                argHeader.fiducialCount = localPixelFiducials.size();
+                argHeader.fiducialCount = result.fiducialCount;
                 for(uint8_t j = 0; j < 10; j++) {
                     if (j < argHeader.fiducialCount){
                         uint8_t jp = (j+argHeader.frameCount) % argHeader.fiducialCount;
-                        argHeader.fiducialX[j] = localPixelFiducials[jp].x;
-                        argHeader.fiducialY[j] = localPixelFiducials[jp].y;
+                        argHeader.fiducialX[j] = result.pixelFiducials[jp].x;
+                        argHeader.fiducialY[j] = result.pixelFiducials[jp].y;
                     } else {
                         argHeader.fiducialX[j] = 0;
                         argHeader.fiducialY[j] = 0;
@@ -684,19 +657,19 @@ void image_process(int camera_id, cv::Mat &argFrame, HeaderData &argHeader)
                 }
 
             case FIDUCIAL_ERROR:
-                argHeader.sunCenter[0] = localPixelCenter.x;
-                argHeader.sunCenter[1] = localPixelCenter.y;
+                argHeader.sunCenter[0] = result.pixelCenter.x;
+                argHeader.sunCenter[1] = result.pixelCenter.y;
 
-                argHeader.screenCenterError[0] = localError.x;
-                argHeader.screenCenterError[1] = localError.y;
+                argHeader.screenCenterError[0] = result.pixelError.x;
+                argHeader.screenCenterError[1] = result.pixelError.y;
 
             case CENTER_ERROR:
-                argHeader.limbCount = localLimbs.size();
+                argHeader.limbCount = result.limbCount;
                 for(uint8_t j = 0; j < 10; j++) {
                     if (j < argHeader.limbCount) {
                         uint8_t jp = ((int)(j/2)+argHeader.frameCount+(j % 2)*(int)(argHeader.limbCount/2)) % argHeader.limbCount;
-                        argHeader.limbX[j] = localLimbs[jp].x;
-                        argHeader.limbY[j] = localLimbs[jp].y;
+                        argHeader.limbX[j] = result.limbCrossings[jp].x;
+                        argHeader.limbY[j] = result.limbCrossings[jp].y;
                     } else {
                         argHeader.limbX[j] = 0;
                         argHeader.limbY[j] = 0;
@@ -705,8 +678,8 @@ void image_process(int camera_id, cv::Mat &argFrame, HeaderData &argHeader)
 
             case LIMB_ERROR:
             case RANGE_ERROR:
-                argHeader.imageMinMax[0] = localMin;
-                argHeader.imageMinMax[1] = localMax;
+                argHeader.imageMinMax[0] = result.frameMin;
+                argHeader.imageMinMax[1] = result.frameMax;
                 break;
 
             default:
@@ -940,7 +913,7 @@ void *TelemetryPackagerThread(void *threadargs)
         bitwrite(&status_bitfield, 6, 1, receivedGoodGPS);
         receivedGoodGPS = false;
         bitwrite(&status_bitfield, 5, 1, localHeaders[0].isOutputting);
-        bitwrite(&status_bitfield, 0, 5, localHeaders[0].runResult);
+        bitwrite(&status_bitfield, 0, 5, GetLegacyCode(localHeaders[0].runResult));
         tp << (uint8_t)status_bitfield;
 
         tp << (uint16_t)latest_sas_command_key;
@@ -1990,6 +1963,7 @@ int main(void)
     signal(SIGTERM, &sig_handler);
 
     identifySAS();
+    aspect.SetInteger(CHECKPOINT_INTERVAL, ASPECT_CHECKPOINT_INTERVAL);
     switch (sas_id) {
         case 1:
             isOutputting = true;